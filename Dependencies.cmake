@@ -1,6 +1,7 @@
 
 include(CheckFunctionExists)
 check_function_exists(getopt_long HAVE_GETOPT_LONG)
+check_function_exists(copy_file_range HAVE_COPY_FILE_RANGE)
 
 if (TOOLS)
     if (NOT HAVE_GETOPT_LONG)
@@ -39,6 +40,8 @@ endif (TESTS)
 
 include(CheckIncludeFile)
 CHECK_INCLUDE_FILE(sys/queue.h HAVE_SYS_QUEUE)
+CHECK_INCLUDE_FILE(sys/sendfile.h HAVE_SYS_SENDFILE)
+CHECK_INCLUDE_FILE(linux/fs.h HAVE_LINUX_FS_H)
 
 include(CheckSymbolExists)
 CHECK_SYMBOL_EXISTS(htobe32 endian.h HAVE_ENDIAN_FUNCS)
@@ -23,35 +23,87 @@
 **
 */
 
+#define _GNU_SOURCE /* copy_file_range */
+
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "bpk-config.h"
+#if defined(HAVE_SYS_SENDFILE)
+#include <sys/sendfile.h>
+#endif
+#if defined(HAVE_LINUX_FS_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "bpk.h"
 #include "bpk_priv.h"
 #include "crc32.h"
+#include "cksum.h"
+#include "index.h"
+#include "io.h"
 #include "compat/endian.h"
 
+/* offsets are 64 bits wide even on 32 bits hosts (_FILE_OFFSET_BITS=64) */
+typedef char bpk_off_check[(sizeof (off_t) >= sizeof (uint64_t)) ? 1 : -1];
+
+/**
+ * @brief read some data from a bpk file, using its mapping if any.
+ */
+static ssize_t bpk_pread(bpk *bpk, void *buf, size_t len, off_t off)
+{
+    if (bpk->map != NULL)
+    {
+        if (off < 0 || (bpk_size) off >= bpk->map_size)
+            return 0;
+        if (len > bpk->map_size - off)
+            len = bpk->map_size - off;
+        memcpy(buf, bpk->map + off, len);
+        return len;
+    }
+    return bpk->ops->read_at(bpk->io, buf, len, off);
+}
+
+/**
+ * @brief write some data at a given offset.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_pwrite(bpk *bpk, const void *buf, size_t len, off_t off)
+{
+    bpk->win_len = 0;
+    return bpk->ops->write_at(bpk->io, buf, len, off);
+}
+
 /**
  * @brief initialize a bpk header.
- * @param[in] fd the bpk filedescriptor.
+ * @param[in] bpk the bpk file.
  * @return
  *  0 on success.
  *  -1 on error (errno set accordingly).
  */
-static int bpk_init_header(FILE *fd)
+static int bpk_init_header(bpk *bpk)
 {
     bpk_header hdr;
     hdr.magic = htobe32(BPK_MAGIC);
-    hdr.version = htobe32(BPK_VERSION);
+    hdr.version = htobe32(BPK_VERSION_1_0);
     hdr.size = htobe64(sizeof (bpk_header));
     hdr.crc = 0;
     hdr.spare = 0;
 
-    if (fwrite(&hdr, sizeof (bpk_header), 1, fd) != 1)
+    if (bpk_pwrite(bpk, &hdr, sizeof (bpk_header), 0) != 0)
     {
         errno = EIO;
         return -1;
@@ -60,17 +112,31 @@ static int bpk_init_header(FILE *fd)
         return 0;
 }
 
-static int bpk_check_header(FILE *fd, uint64_t *size)
+/**
+ * @brief raise the version written in the header when the file is closed.
+ * @details packages get the lowest version their content needs, so that
+ * packages without newer features stay readable by older readers.
+ */
+static void bpk_need_version(bpk *bpk, uint32_t version)
+{
+    if (version > bpk->version)
+        bpk->version = version;
+}
+
+static int bpk_check_header(bpk *bpk, uint64_t *size, uint64_t *toc)
 {
     bpk_header hdr;
 
-    if (fread(&hdr, sizeof (bpk_header), 1, fd) != 1)
+    if (bpk_pread(bpk, &hdr, sizeof (bpk_header), 0) !=
+            (ssize_t) sizeof (bpk_header))
         return -1;
 
     hdr.magic = be32toh(hdr.magic);
     hdr.version = be32toh(hdr.version);
     if (size != NULL)
         *size = be64toh(hdr.size);
+    if (toc != NULL)
+        *toc = be64toh(hdr.spare);
 
     if (hdr.magic != BPK_MAGIC ||
             BPK_MAJOR(hdr.version) > BPK_MAJOR(BPK_VERSION))
@@ -78,462 +144,3922 @@ static int bpk_check_header(FILE *fd, uint64_t *size)
     return 0;
 }
 
-bpk *bpk_create(const char *file)
+/**
+ * @brief read some partition header data.
+ * @details headers are read through a large window, so that walking
+ * packages with many small partitions costs a read per window instead of a
+ * read per partition, a new window is only read when a partition data
+ * skips past the current one.
+ *
+ * @return
+ *  - the number of bytes read, which is short at the end of file.
+ *  - -1 on error.
+ */
+static ssize_t bpk_scan_read(bpk *bpk, void *buf, size_t len, off_t off)
 {
-    bpk *ret;
-    FILE *fd = fopen(file, "w+");
+    ssize_t rlen;
 
-    if (fd == NULL)
-        return NULL;
+    if (bpk->map != NULL)
+        return bpk_pread(bpk, buf, len, off);
 
-    if (bpk_init_header(fd) != 0)
+    if (off < bpk->win_off ||
+            (bpk_size) (off - bpk->win_off) + len > bpk->win_len)
     {
-        fclose(fd);
-        return NULL;
+        if (bpk->win == NULL)
+        {
+            bpk->win = malloc(BPK_SCAN_WINDOW);
+            if (bpk->win == NULL)
+                return bpk_pread(bpk, buf, len, off);
+        }
+
+        rlen = bpk_pread(bpk, bpk->win, BPK_SCAN_WINDOW, off);
+        bpk->win_off = off;
+        bpk->win_len = (rlen > 0) ? (size_t) rlen : 0;
+        if (rlen < 0)
+            return -1;
+        if (len > bpk->win_len)
+            len = bpk->win_len;
     }
+    memcpy(buf, bpk->win + (off - bpk->win_off), len);
+    return len;
+}
 
-    ret = malloc(sizeof (bpk));
-    if (ret == NULL)
+/**
+ * @brief get the I/O buffer, allocating it if needed.
+ * @return the buffer (bpk->buff_size bytes) or NULL on allocation failure.
+ */
+static unsigned char *bpk_buffer(bpk *bpk)
+{
+    if (bpk->buff == NULL)
+        bpk->buff = malloc(bpk->buff_size);
+    return bpk->buff;
+}
+
+/**
+ * @brief access some data at a given offset.
+ * @details on mapped files ptr points directly in the mapping, buf being
+ * unused, data is read in buf otherwise.
+ *
+ * @return
+ *  - the number of bytes available in ptr, short at the end of file.
+ *  - -1 on error.
+ */
+static ssize_t bpk_peek(
+        bpk *bpk,
+        void *buf,
+        size_t len,
+        off_t off,
+        const void **ptr)
+{
+    if (bpk->map != NULL)
     {
-        fclose(fd);
-        return NULL;
+        if (off < 0 || (bpk_size) off >= bpk->map_size)
+            return 0;
+        *ptr = bpk->map + off;
+        return (len > bpk->map_size - off) ? bpk->map_size - off : len;
     }
+    *ptr = buf;
+    return bpk_pread(bpk, buf, len, off);
+}
 
-    ret->fd = fd;
-    ret->ppos = ret->psize = 0;
-    ret->size = sizeof (bpk_header);
-    ret->flags = FLAG_CRC;
+/**
+ * @brief give an access pattern hint on a mapped area.
+ */
+static void bpk_advise(bpk *bpk, off_t off, bpk_size len, int advice)
+{
+    off_t start;
+    long page;
 
-    return ret;
+    if (bpk->map == NULL || off < 0 || (bpk_size) off >= bpk->map_size)
+        return;
+
+    page = sysconf(_SC_PAGESIZE);
+    start = off & ~((off_t) page - 1);
+    if (len > bpk->map_size - off)
+        len = bpk->map_size - off;
+    madvise((void *) (bpk->map + start), len + (off - start), advice);
 }
 
-bpk *bpk_open(const char *file, int append)
+/**
+ * @brief read a partition header at a given offset.
+ * @param[in] off the partition header offset.
+ * @param[out] entry the partition description.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error or end of file.
+ */
+static int bpk_read_part_at(bpk *bpk, off_t off, bpk_index_entry *entry)
 {
-    bpk *ret;
-    FILE *fd;
-    uint64_t size = 0;
+    bpk_part part;
 
-    if (append)
-    {
-        fd = fopen(file, "r+");
-        if (fd == NULL)
-            fd = fopen(file, "w+");
+    if (off >= bpk->size)
+        return -1;
+
+    if (bpk_scan_read(bpk, &part, sizeof (bpk_part), off) !=
+            (ssize_t) sizeof (bpk_part))
+        return -1;
+
+    entry->type = be32toh(part.type);
+    entry->size = be64toh(part.size);
+    entry->crc = be32toh(part.crc);
+    entry->hw_id = be32toh(part.hw_id);
+    entry->cksum = be32toh(part.spare) & ~BPK_PART_SPARSE;
+    entry->sparse = (be32toh(part.spare) & BPK_PART_SPARSE) != 0;
+    entry->offset = off + sizeof (bpk_part);
+    return 0;
+}
+
+/**
+ * @brief tell if a partition type is internal to the format.
+ * @details such partitions are skipped by readers.
+ */
+static int bpk_type_hidden(bpk_type type)
+{
+    return type == BPK_TYPE_TOC || type == BPK_TYPE_PAD ||
+        type == BPK_TYPE_DEL;
+}
+
+/**
+ * @brief build the partition index in a single pass over the headers.
+ * @return
+ *  - 0 on success.
+ *  - -1 on allocation failure.
+ */
+static int bpk_build_index(bpk *bpk)
+{
+    bpk_index_entry entry;
+    off_t off = sizeof (bpk_header);
+
+    if (bpk->index != NULL)
+        return 0;
+
+    bpk->index = bpk_index_new();
+    if (bpk->index == NULL)
+        return -1;
 
-        if (fd != NULL)
+    while (bpk_read_part_at(bpk, off, &entry) == 0)
+    {
+        if (!bpk_type_hidden(entry.type) &&
+                bpk_index_add(bpk->index, &entry) != 0)
         {
-            fseek(fd, 0, SEEK_END);
-            if ((ftell(fd) < (long) sizeof (bpk_header)) &&
-                    (bpk_init_header(fd) != 0))
-            {
-                fclose(fd);
-                errno = EIO;
-                fd = NULL;
-            }
-            else
-                fseek(fd, 0, SEEK_SET);
+            bpk_index_free(bpk->index);
+            bpk->index = NULL;
+            errno = ENOMEM;
+            return -1;
         }
+        off = entry.offset + entry.size;
     }
-    else
-        fd = fopen(file, "r");
+    return 0;
+}
 
-    if (fd == NULL)
-        return NULL;
-    else if (bpk_check_header(fd, &size) != 0)
-    {
-        fclose(fd);
-        errno = EILSEQ;
-        return NULL;
-    }
+/**
+ * @brief load the partition index from a table of contents.
+ * @details the table of contents is only trusted if it's the last partition
+ * of the file, and its checksum matches.
+ *
+ * @param[in] bpk the bpk file.
+ * @param[in] off the table of contents partition header offset.
+ * @return
+ *  - 0 on success.
+ *  - -1 if there's no valid table of contents.
+ */
+static int bpk_load_toc(bpk *bpk, off_t off)
+{
+    bpk_index_entry part, entry;
+    bpk_toc_entry *toc;
+    bpk_index *index;
+    size_t i, count, len;
+    int ret = 0;
+
+    /* the table is read at once, it must fit in memory (32 bits hosts) */
+    if (off < (off_t) sizeof (bpk_header) ||
+            bpk_read_part_at(bpk, off, &part) != 0 ||
+            part.type != BPK_TYPE_TOC || part.cksum != BPK_CKSUM_CRC32 ||
+            part.offset + (off_t) part.size != bpk->size ||
+            part.size > (bpk_size) SSIZE_MAX ||
+            (part.size % sizeof (bpk_toc_entry)) != 0)
+        return -1;
 
-    ret = malloc(sizeof (bpk));
-    if (ret == NULL)
-        return NULL;
+    len = part.size;
+    count = len / sizeof (bpk_toc_entry);
+    toc = malloc(len + 1);
+    index = bpk_index_new();
+    if (toc == NULL || index == NULL ||
+            bpk_pread(bpk, toc, len, part.offset) != (ssize_t) len ||
+            bpk_crc32(toc, len, BPK_CRC_SEED) != part.crc)
+        ret = -1;
 
-    ret->fd = fd;
-    ret->ppos = ret->psize = 0;
-    ret->flags = (append) ? FLAG_CRC : 0;
-    ret->size = size;
+    for (i = 0; ret == 0 && i < count; ++i)
+    {
+        entry.type = be32toh(toc[i].type);
+        entry.hw_id = be32toh(toc[i].hw_id);
+        entry.offset = be64toh(toc[i].offset);
+        entry.size = be64toh(toc[i].size);
+        entry.crc = be32toh(toc[i].crc);
+        entry.cksum = be32toh(toc[i].cksum) & ~BPK_PART_SPARSE;
+        entry.sparse = (be32toh(toc[i].cksum) & BPK_PART_SPARSE) != 0;
+
+        if (entry.offset < (off_t) (sizeof (bpk_header) + sizeof (bpk_part)) ||
+                entry.offset > off ||
+                entry.size > (bpk_size) (off - entry.offset) ||
+                bpk_index_add(index, &entry) != 0)
+            ret = -1;
+    }
+    free(toc);
 
-    return ret;
+    if (ret != 0)
+    {
+        bpk_index_free(index);
+        return -1;
+    }
+    bpk_index_free(bpk->index);
+    bpk->index = index;
+    bpk->toc = off;
+    return 0;
 }
 
-uint32_t bpk_compute_crc(bpk *bpk, uint32_t *file_crc)
+/**
+ * @brief compute the crc of all the partition headers.
+ * @param[in] bpk the bpk file.
+ * @param[in] size the bpk file size, as found in its header.
+ * @param[out] crc the crc of the concatenated partition headers.
+ * @param[out] len the length of the concatenated partition headers.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the partitions don't match the file size.
+ */
+static int bpk_parts_crc(bpk *bpk, uint64_t size, uint32_t *crc, uint64_t *len)
 {
-    long pos;
+    off_t pos = sizeof (bpk_header);
     bpk_part part;
-    bpk_header hdr;
-
-    pos = ftell(bpk->fd);
-    fseek(bpk->fd, 0, SEEK_SET);
-
-    if (fread(&hdr, sizeof (bpk_header), 1, bpk->fd) != 1)
-        return 0xFFFFFFFF;
-
-    if (file_crc != NULL)
-        *file_crc = be32toh(hdr.crc);
-    hdr.crc = 0;
 
-    hdr.crc = bpk_crc32((unsigned char const *) &hdr, sizeof (bpk_header),
-            BPK_CRC_SEED);
-    hdr.size = be64toh(hdr.size) - sizeof (bpk_header);
+    *crc = BPK_CRC_SEED;
+    *len = 0;
+    if (size < sizeof (bpk_header))
+        return -1;
+    size -= sizeof (bpk_header);
 
-    while (hdr.size != 0)
+    while (size != 0)
     {
-        if (hdr.size < sizeof (bpk_part))
+        if (size < sizeof (bpk_part))
             break;
 
-        if (fread(&part, sizeof (bpk_part), 1, bpk->fd) != 1)
+        if (bpk_scan_read(bpk, &part, sizeof (bpk_part), pos) !=
+                (ssize_t) sizeof (bpk_part))
             break;
 
-        hdr.size -= sizeof (bpk_part);
-        hdr.crc = bpk_crc32(&part, sizeof (bpk_part), hdr.crc);
+        size -= sizeof (bpk_part);
+        *crc = bpk_crc32(&part, sizeof (bpk_part), *crc);
+        *len += sizeof (bpk_part);
 
         part.size = be64toh(part.size);
-        if (fseek(bpk->fd, part.size, SEEK_CUR) != 0)
+        if (part.size > size)
             break;
-        hdr.size -= part.size;
+        size -= part.size;
+        pos += sizeof (bpk_part) + part.size;
     }
 
-    fseek(bpk->fd, pos, SEEK_SET);
-    return (hdr.size == 0) ? hdr.crc : 0xFFFFFFFF;
+    return (size == 0) ? 0 : -1;
 }
 
-void bpk_close(bpk *bpk)
+/**
+ * @brief release a sparse partition extent list.
+ */
+static void bpk_sparse_free(bpk_sparse *sp)
 {
-    uint32_t crc;
-    uint64_t size;
-
-    if (bpk == NULL)
+    if (sp == NULL)
         return;
-
-    if (bpk->flags & FLAG_CRC)
-    {
-        size = htobe64(bpk->size);
-        fseek(bpk->fd, offsetof (bpk_header, size), SEEK_SET);
-        fwrite(&size, 1, sizeof (uint64_t), bpk->fd);
-
-        crc = htobe32(bpk_compute_crc(bpk, NULL));
-        fseek(bpk->fd, offsetof (bpk_header, crc), SEEK_SET);
-        fwrite(&crc, 1, sizeof (uint32_t), bpk->fd);
-    }
-    fflush(bpk->fd);
-    fclose(bpk->fd);
-    free(bpk);
-}
-
-int bpk_check_crc(bpk *bpk)
-{
-    uint32_t crc;
-    uint32_t ref_crc;
-
-    crc = bpk_compute_crc(bpk, &ref_crc);
-
-    return ((crc != 0xFFFFFFFF) && (crc == ref_crc)) ? 0 : -1;
+    free(sp->ext);
+    free(sp);
 }
 
-int bpk_write_custom(
-        bpk *bpk,
-        bpk_type type,
-        uint32_t hw_id,
-        bpk_fill_func func,
-        void *func_arg)
+/**
+ * @brief append a data extent to a sparse partition extent list.
+ * @details contiguous extents are merged.
+ * @return
+ *  - 0 on success.
+ *  - -1 on allocation failure.
+ */
+static int bpk_sparse_add(bpk_sparse *sp, bpk_size offset, bpk_size size)
 {
-    char *buff;
-    ssize_t len;
-    bpk_part part;
+    void *ext;
+    bpk_size data = 0;
 
-    part.type = htobe32(type);
-    part.hw_id = htobe32(hw_id);
-    part.spare = 0;
-    part.size = 0;
-    part.crc = BPK_CRC_SEED;
+    if (size == 0)
+        return 0;
 
-    fseek(bpk->fd, bpk->size, SEEK_SET);
-    if (fwrite(&part, sizeof (bpk_part), 1, bpk->fd) != 1)
+    if (sp->count != 0)
     {
-        errno = EIO;
-        return -2;
+        data = sp->ext[sp->count - 1].data + sp->ext[sp->count - 1].size;
+        if (sp->ext[sp->count - 1].offset + sp->ext[sp->count - 1].size ==
+                offset)
+        {
+            sp->ext[sp->count - 1].size += size;
+            return 0;
+        }
     }
-    bpk->size += sizeof (bpk_part);
 
-    buff = malloc(2048);
-    if (buff == NULL)
-        return -5;
-
-    while ((len = func(buff, 2048, func_arg)) > 0)
+    if (sp->count == sp->alloc)
     {
-        part.crc = bpk_crc32(buff, len, part.crc);
-
-        if (fwrite(buff, len, 1, bpk->fd) != 1)
+        ext = realloc(sp->ext, (sp->alloc * 2 + 16) * sizeof (*sp->ext));
+        if (ext == NULL)
         {
-            free(buff);
-            errno = EIO;
-            return -3;
+            errno = ENOMEM;
+            return -1;
         }
-        part.size += len;
-        bpk->size += len;
-    }
-    free(buff);
-    if (len < 0)
-    {
-        errno = EIO;
-        return -4;
+        sp->ext = ext;
+        sp->alloc = sp->alloc * 2 + 16;
     }
-
-    fseek(bpk->fd, - part.size - sizeof (bpk_part) + offsetof(bpk_part, size),
-            SEEK_CUR);
-    part.size = htobe64(part.size);
-    part.crc = htobe32(part.crc);
-
-    fwrite(&part.size, sizeof (bpk_size), 1, bpk->fd);
-    fwrite(&part.crc, sizeof (uint32_t), 1, bpk->fd);
-    fseek(bpk->fd, bpk->size, SEEK_SET);
-
-    bpk->ppos = bpk->psize = 0;
+    sp->ext[sp->count].offset = offset;
+    sp->ext[sp->count].size = size;
+    sp->ext[sp->count].data = data;
+    ++sp->count;
     return 0;
 }
 
-int bpk_write(
-        bpk *bpk,
-        bpk_type type,
-        uint32_t hw_id,
-        const char *file)
+/**
+ * @brief load the extent list of a sparse partition.
+ * @param[in] off the partition data offset.
+ * @param[in] size the partition stored size.
+ * @return the extent list or NULL on error (setting errno).
+ */
+static bpk_sparse *bpk_sparse_load(bpk *bpk, off_t off, bpk_size size)
 {
-    char *buff;
-    size_t len;
-    FILE *fd_in;
-    bpk_part part;
-
-    part.type = htobe32(type);
-    part.hw_id = htobe32(hw_id);
-    part.spare = 0;
-    part.size = 0;
-    part.crc = BPK_CRC_SEED;
-
-    fd_in = fopen(file, "r");
-    if (fd_in == NULL)
-        return -1;
-
-    fseek(bpk->fd, bpk->size, SEEK_SET);
-    if (fwrite(&part, sizeof (bpk_part), 1, bpk->fd) != 1)
+    bpk_sparse_trailer trailer;
+    bpk_extent *table = NULL;
+    bpk_sparse *sp;
+    bpk_size len = 0, end = 0;
+    size_t i, count, table_len;
+    int ret = 0;
+
+    if (size < sizeof (bpk_sparse_trailer) ||
+            bpk_pread(bpk, &trailer, sizeof (trailer),
+                off + size - sizeof (trailer)) != (ssize_t) sizeof (trailer) ||
+            be32toh(trailer.magic) != BPK_SPARSE_MAGIC)
     {
-        fclose(fd_in);
-        errno = EIO;
-        return -2;
+        errno = EILSEQ;
+        return NULL;
     }
-    bpk->size += sizeof (bpk_part);
 
-    buff = malloc(2048);
-    if (buff == NULL)
+    count = be32toh(trailer.count);
+    size -= sizeof (trailer);
+    if (count > size / sizeof (bpk_extent))
     {
-        fclose(fd_in);
-        return -5;
+        errno = EILSEQ;
+        return NULL;
     }
-
-    while ((len = fread(buff, 1, 2048, fd_in)) > 0)
+    else if (count > SSIZE_MAX / sizeof (bpk_extent))
     {
-        part.crc = bpk_crc32(buff, len, part.crc);
+        /* the table is read at once, it must fit in memory (32 bits hosts) */
+        errno = ENOMEM;
+        return NULL;
+    }
+    table_len = count * sizeof (bpk_extent);
+    size -= table_len;
 
-        if (fwrite(buff, len, 1, bpk->fd) != 1)
-        {
-            fclose(fd_in);
-            free(buff);
-            errno = EIO;
-            return -3;
-        }
-        part.size += len;
-        bpk->size += len;
+    sp = calloc(1, sizeof (bpk_sparse));
+    if (sp == NULL || (table = malloc(table_len + 1)) == NULL)
+    {
+        free(sp);
+        errno = ENOMEM;
+        return NULL;
     }
-    free(buff);
-    if (ferror(fd_in) != 0)
+    sp->size = be64toh(trailer.size);
+
+    if (bpk_pread(bpk, table, table_len, off + size) != (ssize_t) table_len)
+        ret = -1;
+
+    for (i = 0; ret == 0 && i < count; ++i)
     {
-        fclose(fd_in);
-        errno = EIO;
-        return -4;
+        bpk_size ext_off = be64toh(table[i].offset);
+        bpk_size ext_size = be64toh(table[i].size);
+
+        /* extents must be ordered and fit in the partition */
+        if (ext_off < end || ext_size > sp->size ||
+                ext_off > sp->size - ext_size || ext_size > size - len)
+            ret = -1;
+        else if (bpk_sparse_add(sp, ext_off, ext_size) != 0)
+            ret = -2;
+        end = ext_off + ext_size;
+        len += ext_size;
     }
-    fclose(fd_in);
+    free(table);
 
-    fseek(bpk->fd, - part.size - sizeof (bpk_part) + offsetof(bpk_part, size),
-            SEEK_CUR);
-    part.size = htobe64(part.size);
-    part.crc = htobe32(part.crc);
+    if (ret == 0 && len != size)
+        ret = -1;
+    if (ret != 0)
+    {
+        bpk_sparse_free(sp);
+        errno = (ret == -2) ? ENOMEM : EILSEQ;
+        return NULL;
+    }
+    return sp;
+}
 
-    fwrite(&part.size, sizeof (bpk_size), 1, bpk->fd);
-    fwrite(&part.crc, sizeof (uint32_t), 1, bpk->fd);
-    fseek(bpk->fd, bpk->size, SEEK_SET);
+/**
+ * @brief find the first extent that ends after a logical position.
+ * @return the extent index, sp->count if there's only a hole left.
+ */
+static size_t bpk_sparse_find(const bpk_sparse *sp, bpk_size pos)
+{
+    size_t lo = 0, hi = sp->count, mid;
 
-    bpk->ppos = bpk->psize = 0;
-    return 0;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (sp->ext[mid].offset + sp->ext[mid].size <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-static int bpk_read_part(bpk *bpk, bpk_part *part)
+/**
+ * @brief feed zeros to a checksum context, for sparse partition holes.
+ */
+static void bpk_cksum_zeros(bpk_cksum_ctx *ctx, bpk_size len)
 {
-    if (ftell(bpk->fd) >= bpk->size)
-        return -1;
+    static const unsigned char zeros[64 * 1024];
 
-    if (fread(part, sizeof (bpk_part), 1, bpk->fd) != 1)
-        return -1;
+    while (len != 0)
+    {
+        size_t n = (len > sizeof (zeros)) ? sizeof (zeros) : len;
 
-    part->type = be32toh(part->type);
-    part->size = be64toh(part->size);
-    part->crc = be32toh(part->crc);
-    part->hw_id = be32toh(part->hw_id);
-    return 0;
+        bpk_cksum_update(ctx, zeros, n);
+        len -= n;
+    }
 }
 
-int bpk_find(
-        bpk *bpk,
-        bpk_type type,
-        uint32_t hw_id,
-        bpk_size *size,
-        uint32_t *crc)
-{
-    bpk_part part;
+/**
+ * @brief position while checksumming the stored data of a sparse partition.
+ */
+typedef struct {
+    size_t idx; /**!< current extent */
+    bpk_size data; /**!< stored data consumed */
+    bpk_size pos; /**!< logical position */
+} bpk_sparse_pos;
 
-    bpk_rewind(bpk);
+/**
+ * @brief feed stored sparse partition data to a checksum context.
+ * @details holes are fed as zeros, bytes after the last extent (the extent
+ * table) are ignored, bpk_sparse_cksum_end feeds the trailing hole.
+ */
+static void bpk_sparse_cksum(
+        bpk_cksum_ctx *ctx,
+        const bpk_sparse *sp,
+        bpk_sparse_pos *sp_pos,
+        const unsigned char *ptr,
+        size_t len)
+{
+    size_t n;
 
-    while (bpk_read_part(bpk, &part) == 0)
+    while (len != 0 && sp_pos->idx < sp->count)
     {
-        if (part.type == type && part.hw_id == hw_id)
+        if (sp_pos->pos < sp->ext[sp_pos->idx].offset)
         {
-            if (size != NULL)
-                *size = part.size;
-            if (crc != NULL)
-                *crc = part.crc;
-            bpk->ppos = 0;
-            bpk->psize = part.size;
-            return 0;
+            bpk_cksum_zeros(ctx, sp->ext[sp_pos->idx].offset - sp_pos->pos);
+            sp_pos->pos = sp->ext[sp_pos->idx].offset;
         }
-        fseek(bpk->fd, part.size, SEEK_CUR);
+
+        n = sp->ext[sp_pos->idx].data + sp->ext[sp_pos->idx].size -
+            sp_pos->data;
+        n = (n > len) ? len : n;
+        bpk_cksum_update(ctx, ptr, n);
+        ptr += n;
+        len -= n;
+        sp_pos->data += n;
+        sp_pos->pos += n;
+        if (sp_pos->data ==
+                sp->ext[sp_pos->idx].data + sp->ext[sp_pos->idx].size)
+            ++sp_pos->idx;
     }
-    return -1;
 }
 
-bpk_type bpk_next(
-        bpk *bpk,
+static void bpk_sparse_cksum_end(
+        bpk_cksum_ctx *ctx,
+        const bpk_sparse *sp,
+        bpk_sparse_pos *sp_pos)
+{
+    if (sp_pos->pos < sp->size)
+        bpk_cksum_zeros(ctx, sp->size - sp_pos->pos);
+    sp_pos->pos = sp->size;
+}
+
+/**
+ * @brief allocate the handle of a new bpk file.
+ * @return the handle, NULL on allocation failure.
+ */
+static bpk *bpk_alloc(int fd)
+{
+    bpk *ret = malloc(sizeof (bpk));
+
+    if (ret == NULL)
+        return NULL;
+
+    ret->fd = fd;
+    ret->ops = &bpk_io_fd;
+    ret->io = &ret->fd;
+    ret->buff = NULL;
+    ret->buff_size = BPK_BUFF_SIZE;
+    ret->win = NULL;
+    ret->win_off = ret->win_len = 0;
+    ret->map = NULL;
+    ret->map_size = 0;
+    ret->ppos = ret->psize = ret->poff = 0;
+    ret->size = ret->next = sizeof (bpk_header);
+    ret->toc = 0;
+    ret->align = 0;
+    ret->flags = FLAG_CRC | FLAG_HCRC;
+    ret->version = BPK_VERSION_1_0;
+    ret->index = NULL;
+    ret->pidx = 0;
+    ret->hcrc = BPK_CRC_SEED;
+    ret->hlen = 0;
+    ret->cksum = ret->pcksum = BPK_CKSUM_CRC32;
+    ret->pcrc = 0;
+    ret->psparse = NULL;
+    ret->stream = NULL;
+
+    return ret;
+}
+
+bpk *bpk_create(const char *file)
+{
+    bpk *ret;
+    int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0)
+        return NULL;
+
+    ret = bpk_alloc(fd);
+    if (ret == NULL || bpk_init_header(ret) != 0)
+    {
+        free(ret);
+        close(fd);
+        return NULL;
+    }
+    return ret;
+}
+
+bpk *bpk_create_stream(int fd)
+{
+    bpk *ret;
+
+    /* the output is written by bpk_stream_end, closed with the handle */
+    fd = dup(fd);
+    if (fd < 0)
+        return NULL;
+
+    ret = bpk_alloc(fd);
+    if (ret == NULL || (ret->stream = calloc(1, sizeof (bpk_stream))) == NULL)
+    {
+        free(ret);
+        close(fd);
+        return NULL;
+    }
+    ret->stream->tail = &ret->stream->head;
+    return ret;
+}
+
+bpk *bpk_open(const char *file, int append)
+{
+    return bpk_open_flags(file, (append) ? BPK_OPEN_APPEND : 0);
+}
+
+/**
+ * @brief tell if a file can be mapped in the address space.
+ * @details larger files are read using positional I/O instead.
+ */
+static int bpk_mappable(off_t size)
+{
+    return size > 0 && (uint64_t) size <= (uint64_t) SSIZE_MAX;
+}
+
+/**
+ * @brief open the package stored on the backend of a new handle.
+ * @details the handle is released on error.
+ * @return
+ *  - the handle.
+ *  - NULL on error (setting errno).
+ */
+static bpk *bpk_open_handle(bpk *ret, int flags)
+{
+    uint64_t size = 0, toc = 0;
+    bpk_size st_size = 0;
+    void *map;
+    int err;
+
+    if (ret->ops->size(ret->io, &st_size) != 0 ||
+            ((flags & BPK_OPEN_APPEND) &&
+             st_size < sizeof (bpk_header) && bpk_init_header(ret) != 0))
+        err = EIO;
+    else if (bpk_check_header(ret, &size, &toc) != 0)
+        err = EILSEQ;
+    else
+        err = 0;
+
+    if (err == 0 && (flags & BPK_OPEN_MMAP) && ret->fd >= 0 &&
+            bpk_mappable(st_size))
+    {
+        map = mmap(NULL, st_size, PROT_READ, MAP_SHARED, ret->fd, 0);
+        if (map == MAP_FAILED)
+            err = errno;
+        else
+        {
+            ret->map = map;
+            ret->map_size = st_size;
+        }
+    }
+
+    ret->flags &= FLAG_USER_IO;
+    if (err != 0)
+    {
+        bpk_close(ret);
+        errno = err;
+        return NULL;
+    }
+
+    ret->flags |= (flags & BPK_OPEN_APPEND) ? FLAG_CRC : 0;
+    ret->size = size;
+    if (toc != 0 && bpk_load_toc(ret, toc) == 0 &&
+            (flags & BPK_OPEN_APPEND))
+    {
+        /* new parts go over the table of contents, rewritten on close */
+        ret->size = ret->toc;
+        ret->toc = 0;
+        ret->flags |= FLAG_TOC | FLAG_TRUNC;
+    }
+
+    if ((flags & BPK_OPEN_INDEX) && bpk_build_index(ret) != 0)
+    {
+        ret->flags &= FLAG_USER_IO;
+        bpk_close(ret);
+        return NULL;
+    }
+
+    /* seed the running header crc, so that closing is cheap */
+    if ((flags & BPK_OPEN_APPEND) &&
+            bpk_parts_crc(ret, ret->size, &ret->hcrc, &ret->hlen) == 0)
+        ret->flags |= FLAG_HCRC;
+
+    return ret;
+}
+
+bpk *bpk_open_flags(const char *file, int flags)
+{
+    bpk *ret;
+    int fd;
+
+    if ((flags & BPK_OPEN_APPEND) && (flags & BPK_OPEN_MMAP))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (flags & BPK_OPEN_APPEND)
+        fd = open(file, O_RDWR | O_CREAT, 0666);
+    else
+        fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    ret = bpk_alloc(fd);
+    if (ret == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    return bpk_open_handle(ret, flags);
+}
+
+bpk *bpk_open_ops(const bpk_io_ops *ops, void *io, int flags)
+{
+    bpk *ret;
+
+    if ((flags & BPK_OPEN_APPEND) && (flags & BPK_OPEN_MMAP))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* file optimizations are kept for file descriptors */
+    ret = bpk_alloc((ops == &bpk_io_fd) ? *(int *) io : -1);
+    if (ret == NULL)
+        return NULL;
+    ret->ops = ops;
+    ret->io = io;
+    ret->flags |= FLAG_USER_IO;
+    return bpk_open_handle(ret, flags);
+}
+
+uint32_t bpk_compute_crc(bpk *bpk, uint32_t *file_crc)
+{
+    bpk_header hdr;
+    uint32_t crc;
+    uint64_t len;
+
+    if (bpk_pread(bpk, &hdr, sizeof (bpk_header), 0) !=
+            (ssize_t) sizeof (bpk_header))
+        return 0xFFFFFFFF;
+
+    if (file_crc != NULL)
+        *file_crc = be32toh(hdr.crc);
+    hdr.crc = 0;
+
+    if (bpk_parts_crc(bpk, be64toh(hdr.size), &crc, &len) != 0)
+        return 0xFFFFFFFF;
+
+    return bpk_crc32_combine(
+            bpk_crc32(&hdr, sizeof (bpk_header), BPK_CRC_SEED), crc, len);
+}
+
+/**
+ * @brief write the table of contents partition.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_write_toc(bpk *bpk);
+
+void bpk_close(bpk *bpk)
+{
+    bpk_header hdr;
+    uint32_t crc;
+
+    if (bpk == NULL)
+        return;
+
+    /* streamed packages are written at once */
+    if (bpk->stream != NULL && (bpk->flags & FLAG_CRC))
+        bpk_stream_end(bpk);
+
+    if (bpk->flags & FLAG_CRC)
+    {
+        if ((bpk->flags & FLAG_TOC) && bpk_write_toc(bpk) != 0)
+            bpk->toc = 0;
+        if (bpk->flags & FLAG_TRUNC)
+            bpk->ops->truncate(bpk->io, bpk->size);
+    }
+
+    if ((bpk->flags & FLAG_CRC) &&
+            bpk_pread(bpk, &hdr, sizeof (bpk_header), 0) ==
+            (ssize_t) sizeof (bpk_header))
+    {
+        hdr.size = htobe64(bpk->size);
+        hdr.spare = htobe64(bpk->toc);
+        if (be32toh(hdr.version) < bpk->version)
+            hdr.version = htobe32(bpk->version);
+        hdr.crc = 0;
+
+        if (bpk->flags & FLAG_HCRC)
+        {
+            crc = bpk_crc32(&hdr, sizeof (bpk_header), BPK_CRC_SEED);
+            crc = bpk_crc32_combine(crc, bpk->hcrc, bpk->hlen);
+        }
+        else
+        {
+            bpk_pwrite(bpk, &hdr, sizeof (bpk_header), 0);
+            crc = bpk_compute_crc(bpk, NULL);
+        }
+        hdr.crc = htobe32(crc);
+        bpk_pwrite(bpk, &hdr, sizeof (bpk_header), 0);
+
+        if ((bpk->flags & FLAG_USER_IO) && bpk->ops->sync != NULL)
+            bpk->ops->sync(bpk->io);
+    }
+    if (bpk->map != NULL)
+        munmap((void *) bpk->map, bpk->map_size);
+    if (!(bpk->flags & FLAG_USER_IO))
+        close(bpk->fd);
+    bpk_index_free(bpk->index);
+    bpk_sparse_free(bpk->psparse);
+    free(bpk->stream);
+    free(bpk->win);
+    free(bpk->buff);
+    free(bpk);
+}
+
+int bpk_set_buffer_size(bpk *bpk, size_t size)
+{
+    if (size < sizeof (bpk_part))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    free(bpk->buff);
+    bpk->buff = NULL;
+    bpk->buff_size = size;
+    return 0;
+}
+
+size_t bpk_get_buffer_size(bpk *bpk)
+{
+    return bpk->buff_size;
+}
+
+int bpk_check_crc(bpk *bpk)
+{
+    uint32_t crc;
+    uint32_t ref_crc;
+
+    crc = bpk_compute_crc(bpk, &ref_crc);
+
+    return ((crc != 0xFFFFFFFF) && (crc == ref_crc)) ? 0 : -1;
+}
+
+/**
+ * @brief add a new result to a bpk_verify_all results array.
+ * @return the new result or NULL on allocation failure.
+ */
+static bpk_verify_result *bpk_verify_add(
+        bpk_verify_result **results,
+        size_t *count,
+        size_t *alloc)
+{
+    bpk_verify_result *res;
+
+    if (*count == *alloc)
+    {
+        *alloc = (*alloc != 0) ? *alloc * 2 : 16;
+        res = realloc(*results, *alloc * sizeof (bpk_verify_result));
+        if (res == NULL)
+            return NULL;
+        *results = res;
+    }
+    return &(*results)[(*count)++];
+}
+
+int bpk_verify_all(
+        bpk *bpk,
+        bpk_verify_result **results,
+        size_t *count)
+{
+    bpk_verify_result *res = NULL, *cur = NULL;
+    size_t res_count = 0, res_alloc = 0;
+    unsigned char *buff;
+    const unsigned char *ptr;
+    size_t avail = 0, len;
+    ssize_t rlen;
+    off_t pos;
+    bpk_header hdr;
+    bpk_part part;
+    size_t part_len = 0;
+    bpk_size data_left = 0;
+    uint64_t remaining;
+    uint32_t hdr_crc, file_crc;
+    size_t i;
+    bpk_cksum_ctx ctx;
+    bpk_sparse *sp = NULL;
+    bpk_sparse_pos sp_pos;
+    int ret = 0;
+
+    buff = bpk_buffer(bpk);
+    if (buff == NULL)
+        return -3;
+    ptr = buff;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(bpk->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    bpk_advise(bpk, 0, bpk->map_size, MADV_SEQUENTIAL);
+    if (bpk_pread(bpk, &hdr, sizeof (bpk_header), 0) !=
+            (ssize_t) sizeof (bpk_header))
+    {
+        errno = EIO;
+        return -3;
+    }
+
+    file_crc = be32toh(hdr.crc);
+    hdr.crc = 0;
+    hdr_crc = bpk_crc32(&hdr, sizeof (bpk_header), BPK_CRC_SEED);
+    remaining = be64toh(hdr.size) - sizeof (bpk_header);
+    pos = sizeof (bpk_header);
+
+    while (remaining != 0)
+    {
+        if (avail == 0)
+        {
+            len = (remaining > bpk->buff_size) ? bpk->buff_size : remaining;
+            rlen = bpk_peek(bpk, buff, len, pos, (const void **) &ptr);
+            if (rlen <= 0)
+                break;
+            avail = rlen;
+            pos += rlen;
+        }
+
+        if (cur == NULL)
+        {
+            /* part header, may span several reads */
+            len = sizeof (bpk_part) - part_len;
+            len = (avail > len) ? len : avail;
+            memcpy(((unsigned char *) &part) + part_len, ptr, len);
+            part_len += len;
+
+            if (part_len == sizeof (bpk_part))
+            {
+                hdr_crc = bpk_crc32(&part, sizeof (bpk_part), hdr_crc);
+                part_len = 0;
+
+                cur = bpk_verify_add(&res, &res_count, &res_alloc);
+                if (cur == NULL)
+                {
+                    ret = -3;
+                    break;
+                }
+                cur->type = be32toh(part.type);
+                cur->hw_id = be32toh(part.hw_id);
+                cur->size = data_left = be64toh(part.size);
+                cur->cksum = be32toh(part.spare) & ~BPK_PART_SPARSE;
+                cur->crc = be32toh(part.crc);
+                cur->computed = 0xFFFFFFFF;
+                cur->status = (bpk_cksum_init(&ctx, cur->cksum) == 0) ?
+                    BPK_VERIFY_OK : BPK_VERIFY_CKSUM;
+
+                if ((be32toh(part.spare) & BPK_PART_SPARSE) &&
+                        cur->status == BPK_VERIFY_OK)
+                {
+                    /* the extent table is needed before the data */
+                    sp = bpk_sparse_load(bpk, pos - avail + len, data_left);
+                    memset(&sp_pos, 0, sizeof (sp_pos));
+                    if (sp == NULL)
+                        cur->status = BPK_VERIFY_CRC;
+                }
+            }
+        }
+        else
+        {
+            len = (avail > data_left) ? data_left : avail;
+            if (cur->status == BPK_VERIFY_OK && sp != NULL)
+                bpk_sparse_cksum(&ctx, sp, &sp_pos, ptr, len);
+            else if (cur->status == BPK_VERIFY_OK)
+                bpk_cksum_update(&ctx, ptr, len);
+            data_left -= len;
+        }
+
+        if (cur != NULL && data_left == 0)
+        {
+            if (sp != NULL)
+            {
+                bpk_sparse_cksum_end(&ctx, sp, &sp_pos);
+                bpk_sparse_free(sp);
+                sp = NULL;
+            }
+            if (cur->status == BPK_VERIFY_OK)
+            {
+                cur->computed = bpk_cksum_final(&ctx);
+                if (cur->computed != cur->crc)
+                    cur->status = BPK_VERIFY_CRC;
+            }
+            cur = NULL;
+        }
+
+        ptr += len;
+        avail -= len;
+        remaining -= len;
+    }
+
+    bpk_sparse_free(sp);
+    if (ret == 0)
+    {
+        if (cur != NULL)
+            cur->status = BPK_VERIFY_TRUNCATED;
+
+        if (remaining != 0 || part_len != 0 || hdr_crc != file_crc)
+            ret = -1;
+        else
+        {
+            for (len = 0; len < res_count; ++len)
+            {
+                if (res[len].status != BPK_VERIFY_OK)
+                    ret = -2;
+            }
+        }
+
+        /* internal partitions are verified, but not listed */
+        for (i = len = 0; i < res_count; ++i)
+        {
+            if (!bpk_type_hidden(res[i].type))
+                res[len++] = res[i];
+        }
+        res_count = len;
+    }
+
+    if (ret == -3 || results == NULL)
+        free(res);
+    else
+        *results = res;
+    if (count != NULL)
+        *count = (ret == -3) ? 0 : res_count;
+
+    bpk_rewind(bpk);
+    if (ret == -3)
+        errno = ENOMEM;
+    return ret;
+}
+
+int bpk_set_toc(bpk *bpk, int enable)
+{
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (enable)
+    {
+        /* keep the index up to date while writing */
+        if (bpk_build_index(bpk) != 0)
+            return -1;
+        bpk->flags |= FLAG_TOC;
+    }
+    else
+        bpk->flags &= ~FLAG_TOC;
+    return 0;
+}
+
+int bpk_set_align(bpk *bpk, size_t align)
+{
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -1;
+    }
+    else if ((align & (align - 1)) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    bpk->align = align;
+    return 0;
+}
+
+int bpk_set_sparse(bpk *bpk, int enable)
+{
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -1;
+    }
+    else if (bpk->stream != NULL && enable)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enable)
+        bpk->flags |= FLAG_SPARSE;
+    else
+        bpk->flags &= ~FLAG_SPARSE;
+    return 0;
+}
+
+/**
+ * @brief reserve some space after the end of the file.
+ * @details the space is allocated without changing the file size, it's
+ * released when closing the file if left unused.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_prealloc(bpk *bpk, off_t off, bpk_size len)
+{
+#if defined(FALLOC_FL_KEEP_SIZE)
+    if (len == 0)
+        return 0;
+    else if (bpk->fd < 0)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    else if (fallocate(bpk->fd, FALLOC_FL_KEEP_SIZE, off, len) != 0)
+        return -1;
+    bpk->flags |= FLAG_PREALLOC | FLAG_TRUNC;
+    return 0;
+#else
+    (void) bpk;
+    (void) off;
+    (void) len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int bpk_set_prealloc(bpk *bpk, bpk_size size, size_t count)
+{
+    bpk_size part = sizeof (bpk_part);
+
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* worst case padding: a padding part and almost align bytes */
+    if (bpk->align > 1)
+        part += sizeof (bpk_part) + bpk->align;
+    if (count > (UINT64_MAX - size) / part)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    return bpk_prealloc(bpk, bpk->size, size + count * part);
+}
+
+int bpk_set_cksum(bpk *bpk, bpk_cksum algo)
+{
+    bpk_cksum_ctx ctx;
+
+    if (bpk_cksum_init(&ctx, algo) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    bpk->cksum = algo;
+    return 0;
+}
+
+bpk_cksum bpk_get_cksum(bpk *bpk)
+{
+    return bpk->pcksum;
+}
+
+/**
+ * @brief compute the padding needed before a partition header.
+ * @param[in] align the data alignment.
+ * @param[in] off the partition header offset.
+ * @return the padding partition data size, -1 if no padding is needed.
+ */
+static ssize_t bpk_pad_size(size_t align, off_t off)
+{
+    if (align <= 1 || ((off + sizeof (bpk_part)) % align) == 0)
+        return -1;
+    return (align - ((off + 2 * sizeof (bpk_part)) % align)) % align;
+}
+
+/**
+ * @brief fill the header of a padding partition made of zeros.
+ */
+static void bpk_pad_header(bpk_part *part, bpk_size len)
+{
+    bpk_cksum_ctx ctx;
+
+    bpk_cksum_init(&ctx, BPK_CKSUM_CRC32);
+    bpk_cksum_zeros(&ctx, len);
+
+    part->type = htobe32(BPK_TYPE_PAD);
+    part->hw_id = 0;
+    part->spare = htobe32(BPK_CKSUM_CRC32);
+    part->size = htobe64(len);
+    part->crc = htobe32(bpk_cksum_final(&ctx));
+}
+
+/**
+ * @brief write zeros over a range of the file, punching a hole if possible.
+ */
+static int bpk_zero_range(bpk *bpk, off_t off, bpk_size len)
+{
+    static const unsigned char zeros[4096];
+    size_t n;
+
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (len == 0 || (bpk->fd >= 0 && fallocate(bpk->fd,
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0))
+        return 0;
+#endif
+    for (; len != 0; len -= n, off += n)
+    {
+        n = (len > sizeof (zeros)) ? sizeof (zeros) : len;
+        if (bpk_pwrite(bpk, zeros, n, off) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief insert a padding partition, so that the next partition data is
+ * aligned.
+ * @details padding data is made of zeros, left as a hole in the file.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_write_pad(bpk *bpk)
+{
+    bpk_part part;
+    ssize_t len = bpk_pad_size(bpk->align, bpk->size);
+
+    if (len < 0)
+        return 0;
+    bpk_pad_header(&part, len);
+
+    /* drop anything left after the end (an old toc) before making the hole,
+     * unless some space was reserved there */
+    if (((bpk->flags & FLAG_PREALLOC) ?
+                bpk_zero_range(bpk, bpk->size + sizeof (bpk_part), len) :
+                bpk->ops->truncate(bpk->io, bpk->size)) != 0 ||
+            bpk_pwrite(bpk, &part, sizeof (bpk_part), bpk->size) != 0 ||
+            bpk->ops->truncate(bpk->io,
+                bpk->size + sizeof (bpk_part) + len) != 0)
+        return -1;
+
+    bpk->hcrc = bpk_crc32(&part, sizeof (bpk_part), bpk->hcrc);
+    bpk->hlen += sizeof (bpk_part);
+    bpk->size += sizeof (bpk_part) + len;
+    return 0;
+}
+
+/**
+ * @brief write the header of a new partition and prepare its checksum.
+ * @details when the data size is known in advance (size isn't
+ * BPK_SIZE_UNKNOWN) it's written in the header right away and the space is
+ * preallocated, only the checksum is then left to patch.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_part_begin(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size size,
+        bpk_part *part,
+        bpk_cksum_ctx *ctx)
+{
+    if (!bpk_type_hidden(type) && bpk_write_pad(bpk) != 0)
+        return -1;
+
+    /* sparse partitions size depends on their content */
+    if (bpk->flags & FLAG_SPARSE)
+        size = BPK_SIZE_UNKNOWN;
+    if (size != BPK_SIZE_UNKNOWN)
+        bpk_prealloc(bpk, bpk->size, sizeof (bpk_part) + size); /* a hint */
+
+    part->type = htobe32(type);
+    part->hw_id = htobe32(hw_id);
+    part->spare = htobe32(bpk->cksum);
+    part->size = (size != BPK_SIZE_UNKNOWN) ? htobe64(size) : 0;
+    if (bpk->cksum != BPK_CKSUM_CRC32)
+        bpk_need_version(bpk, BPK_VERSION_CKSUM);
+    part->crc = BPK_CRC_SEED;
+    bpk_cksum_init(ctx, bpk->cksum);
+
+    if (bpk_pwrite(bpk, part, sizeof (bpk_part), bpk->size) != 0)
+        return -1;
+    part->size = 0;
+    bpk->size += sizeof (bpk_part);
+    return 0;
+}
+
+/**
+ * @brief patch the header of the partition being written, once its size and
+ * checksum are known.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_part_end(bpk *bpk, bpk_part *part, bpk_cksum_ctx *ctx)
+{
+    off_t offset = bpk->size - part->size - sizeof (bpk_part);
+    bpk_index_entry entry;
+
+    if (bpk->index != NULL && !bpk_type_hidden(be32toh(part->type)))
+    {
+        entry.type = be32toh(part->type);
+        entry.hw_id = be32toh(part->hw_id);
+        entry.cksum = be32toh(part->spare) & ~BPK_PART_SPARSE;
+        entry.sparse = (be32toh(part->spare) & BPK_PART_SPARSE) != 0;
+        entry.crc = bpk_cksum_final(ctx);
+        entry.offset = offset + sizeof (bpk_part);
+        entry.size = part->size;
+        if (bpk_index_add(bpk->index, &entry) != 0)
+        {
+            /* will be rebuilt on demand */
+            bpk_index_free(bpk->index);
+            bpk->index = NULL;
+        }
+        else
+            bpk->pidx = bpk->index->count;
+    }
+
+    part->size = htobe64(part->size);
+    part->crc = htobe32(bpk_cksum_final(ctx));
+    bpk->hcrc = bpk_crc32(part, sizeof (bpk_part), bpk->hcrc);
+    bpk->hlen += sizeof (bpk_part);
+
+    bpk->ppos = bpk->psize = bpk->poff = 0;
+    bpk->next = bpk->size;
+    return bpk_pwrite(bpk, part, sizeof (bpk_part), offset);
+}
+
+/**
+ * @brief tell if a block is made of zeros.
+ * @details the block is compared with itself shifted by one byte, so that
+ * the scan is done by the (vectorized) libc memcmp.
+ */
+static int bpk_is_zero(const unsigned char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/**
+ * @brief write streamed data in the partition being written.
+ * @details when sp is not NULL, zero blocks are left out and recorded as
+ * holes.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_part_data(
+        bpk *bpk,
+        bpk_part *part,
+        bpk_cksum_ctx *ctx,
+        bpk_sparse *sp,
+        const unsigned char *buf,
+        size_t len)
+{
+    size_t i, j, n = 0;
+
+    bpk_cksum_update(ctx, buf, len);
+    if (sp == NULL)
+    {
+        if (bpk_pwrite(bpk, buf, len, bpk->size) != 0)
+            return -1;
+        part->size += len;
+        bpk->size += len;
+        return 0;
+    }
+
+    for (i = 0; i < len; i = j)
+    {
+        /* a run of data blocks, written at once, blocks are aligned on the
+         * partition content whatever the size of the chunks */
+        for (j = i; j < len; j += n)
+        {
+            n = BPK_SPARSE_BLOCK - (sp->size + j) % BPK_SPARSE_BLOCK;
+            n = (len - j > n) ? n : len - j;
+            if (bpk_is_zero(buf + j, n))
+                break;
+        }
+
+        if (j != i)
+        {
+            if (bpk_pwrite(bpk, buf + i, j - i, bpk->size) != 0 ||
+                    bpk_sparse_add(sp, sp->size + i, j - i) != 0)
+                return -1;
+            part->size += j - i;
+            bpk->size += j - i;
+        }
+
+        /* then the zero block that ended it, left as a hole */
+        if (j < len)
+            j += n;
+    }
+    sp->size += len;
+    return 0;
+}
+
+/**
+ * @brief write the extent table of the sparse partition being written.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_sparse_end(bpk *bpk, bpk_part *part, const bpk_sparse *sp)
+{
+    bpk_extent *table;
+    bpk_sparse_trailer *trailer;
+    size_t i, len;
+    int ret;
+
+    len = sp->count * sizeof (bpk_extent) + sizeof (bpk_sparse_trailer);
+    table = malloc(len);
+    if (table == NULL)
+        return -1;
+
+    for (i = 0; i < sp->count; ++i)
+    {
+        table[i].offset = htobe64(sp->ext[i].offset);
+        table[i].size = htobe64(sp->ext[i].size);
+    }
+    trailer = (bpk_sparse_trailer *) (table + sp->count);
+    trailer->size = htobe64(sp->size);
+    trailer->count = htobe32(sp->count);
+    trailer->magic = htobe32(BPK_SPARSE_MAGIC);
+
+    ret = bpk_pwrite(bpk, table, len, bpk->size);
+    free(table);
+    if (ret == 0)
+    {
+        part->size += len;
+        bpk->size += len;
+        part->spare = htobe32(be32toh(part->spare) | BPK_PART_SPARSE);
+        bpk_need_version(bpk, BPK_VERSION_SPARSE);
+    }
+    return ret;
+}
+
+/**
+ * @brief list the data extents of a file, using SEEK_DATA and SEEK_HOLE.
+ * @return
+ *  - the extent list.
+ *  - NULL if the file has no holes, or if they can't be listed.
+ */
+static bpk_sparse *bpk_file_extents(int fd, off_t size)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    bpk_sparse *sp = calloc(1, sizeof (bpk_sparse));
+    off_t data, hole = 0;
+
+    if (sp == NULL)
+        return NULL;
+
+    while (hole < size)
+    {
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break; /* the file ends with a hole */
+        hole = (data < 0) ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole > size)
+            hole = size;
+
+        if (hole < 0 || bpk_sparse_add(sp, data, hole - data) != 0)
+        {
+            bpk_sparse_free(sp);
+            return NULL;
+        }
+    }
+    sp->size = size;
+
+    if (sp->count == 1 && sp->ext[0].size == (bpk_size) size)
+    {
+        bpk_sparse_free(sp);
+        return NULL;
+    }
+    return sp;
+#else
+    (void) fd;
+    (void) size;
+    return NULL;
+#endif
+}
+
+static int bpk_write_toc(bpk *bpk)
+{
+    bpk_toc_entry *toc;
+    bpk_part part;
+    bpk_cksum_ctx ctx;
+    bpk_cksum cksum = bpk->cksum;
+    off_t off = bpk->size;
+    size_t i, len;
+    int ret;
+
+    if (bpk_build_index(bpk) != 0)
+        return -1;
+
+    len = bpk->index->count * sizeof (bpk_toc_entry);
+    toc = malloc(len + 1);
+    if (toc == NULL)
+        return -1;
+
+    for (i = 0; i < bpk->index->count; ++i)
+    {
+        const bpk_index_entry *entry = &bpk->index->parts[i];
+
+        toc[i].type = htobe32(entry->type);
+        toc[i].hw_id = htobe32(entry->hw_id);
+        toc[i].offset = htobe64(entry->offset);
+        toc[i].size = htobe64(entry->size);
+        toc[i].crc = htobe32(entry->crc);
+        toc[i].cksum = htobe32(entry->cksum |
+                ((entry->sparse) ? BPK_PART_SPARSE : 0));
+    }
+
+    bpk->cksum = BPK_CKSUM_CRC32;
+    ret = bpk_part_begin(bpk, BPK_TYPE_TOC, 0, len, &part, &ctx);
+    bpk->cksum = cksum;
+
+    if (ret == 0)
+    {
+        bpk_cksum_update(&ctx, toc, len);
+        ret = bpk_pwrite(bpk, toc, len, bpk->size);
+    }
+    free(toc);
+
+    if (ret == 0)
+    {
+        part.size = len;
+        bpk->size += len;
+        ret = bpk_part_end(bpk, &part, &ctx);
+    }
+    bpk->toc = (ret == 0) ? off : 0;
+    if (ret == 0)
+        bpk_need_version(bpk, BPK_VERSION_TOC);
+    return ret;
+}
+
+/**
+ * @brief write a whole buffer to a file, which may not be seekable.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_write_fd(int fd, const void *buf, size_t len)
+{
+    ssize_t wlen;
+
+    while (len != 0)
+    {
+        wlen = write(fd, buf, len);
+        if (wlen < 0 && errno == EINTR)
+            continue;
+        else if (wlen <= 0)
+        {
+            if (wlen == 0)
+                errno = EIO;
+            return -1;
+        }
+        buf = (const unsigned char *) buf + wlen;
+        len -= wlen;
+    }
+    return 0;
+}
+
+/**
+ * @brief bpk_fill_func reading a file until its end.
+ */
+static ssize_t bpk_fill_read(void *buf, size_t count, void *arg)
+{
+    ssize_t len;
+
+    do
+        len = read(*(int *) arg, buf, count);
+    while (len < 0 && errno == EINTR);
+    return len;
+}
+
+/**
+ * @brief queue a part in a streamed package.
+ * @details files are only read when the package is written, data provided
+ * by func is buffered, up to BPK_STREAM_MAX bytes for the whole package.
+ *
+ * @param[in] file the input file, NULL to read data from func.
+ * @param[in] size the part size, BPK_SIZE_UNKNOWN if not known.
+ * @return
+ *  - 0 on success.
+ *  - -2 if the package was already written (EBADF).
+ *  - -4 if func fails or doesn't provide size bytes (EIO).
+ *  - -5 on allocation failure (EFBIG if too much data is buffered).
+ */
+static int bpk_stream_add(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        const char *file,
+        bpk_size size,
+        bpk_fill_func func,
+        void *func_arg)
+{
+    bpk_stream *stream = bpk->stream;
+    bpk_stream_part *part;
+    bpk_cksum_ctx ctx;
+    unsigned char *data;
+    size_t alloc = 0;
+    ssize_t len = 0;
+    int ret = 0;
+
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -2;
+    }
+
+    part = calloc(1, sizeof (bpk_stream_part));
+    if (part == NULL)
+        return -5;
+    part->type = type;
+    part->hw_id = hw_id;
+    part->cksum = bpk->cksum;
+    part->align = bpk->align;
+    part->size = (file != NULL) ? size : 0;
+
+    if (file != NULL && (part->file = strdup(file)) == NULL)
+        ret = -5;
+
+    while (ret == 0 && file == NULL)
+    {
+        if (part->size == alloc)
+        {
+            /* grow the buffer, within the package budget */
+            alloc = (alloc != 0) ? 2 * alloc : bpk->buff_size;
+            if (alloc > BPK_STREAM_MAX - stream->buffered)
+                alloc = BPK_STREAM_MAX - stream->buffered;
+            if (alloc == part->size)
+            {
+                unsigned char *buff = bpk_buffer(bpk);
+
+                len = (buff != NULL) ?
+                    func(buff, bpk->buff_size, func_arg) : -1;
+                if (len > 0)
+                    errno = EFBIG;
+                if (len != 0)
+                    ret = (len > 0 || buff == NULL) ? -5 : -4;
+                break;
+            }
+
+            data = realloc(part->data, alloc);
+            if (data == NULL)
+            {
+                ret = -5;
+                break;
+            }
+            part->data = data;
+        }
+
+        len = func(part->data + part->size, alloc - part->size, func_arg);
+        if (len <= 0)
+        {
+            if (len < 0)
+                ret = -4;
+            break;
+        }
+        part->size += len;
+    }
+
+    if (ret == 0 && file == NULL)
+    {
+        if (size != BPK_SIZE_UNKNOWN && part->size != size)
+            ret = -4;
+        bpk_cksum_init(&ctx, part->cksum);
+        bpk_cksum_update(&ctx, part->data, part->size);
+        part->crc = bpk_cksum_final(&ctx);
+    }
+
+    if (ret != 0)
+    {
+        if (ret == -4)
+            errno = EIO;
+        free(part->file);
+        free(part->data);
+        free(part);
+        return ret;
+    }
+
+    stream->buffered += (file == NULL) ? part->size : 0;
+    *stream->tail = part;
+    stream->tail = &part->next;
+    return 0;
+}
+
+/**
+ * @brief queue a file in a streamed package.
+ * @details regular files are read when the package is written, other files
+ * are buffered.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the file can't be opened.
+ *  - < -1 as bpk_stream_add.
+ */
+static int bpk_stream_write(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        const char *file)
+{
+    struct stat st;
+    int fd, ret;
+
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -2;
+    }
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        ret = bpk_stream_add(bpk, type, hw_id, file, st.st_size, NULL, NULL);
+    else
+        ret = bpk_stream_add(bpk, type, hw_id, NULL, BPK_SIZE_UNKNOWN,
+                bpk_fill_read, &fd);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief read a queued file, to checksum it or to copy it to the output.
+ * @details the file must not change between both reads, files are copied
+ * in-kernel when possible.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_stream_file(bpk *bpk, bpk_stream_part *part, int copy)
+{
+    unsigned char *buff = bpk_buffer(bpk);
+    bpk_cksum_ctx ctx;
+    bpk_size left = part->size;
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    fd = open(part->file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (buff == NULL || fstat(fd, &st) != 0 ||
+            (bpk_size) st.st_size != part->size)
+    {
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(HAVE_SYS_SENDFILE)
+    while (copy && left != 0)
+    {
+        len = sendfile(bpk->fd, fd, NULL,
+                (left > BPK_COPY_MAX) ? BPK_COPY_MAX : left);
+        if (len < 0 && errno == EINTR)
+            continue;
+        else if (len <= 0)
+            break; /* not supported, or truncated (found below) */
+        left -= len;
+    }
+#endif
+
+    bpk_cksum_init(&ctx, part->cksum);
+    while (left != 0)
+    {
+        len = read(fd, buff, (left > bpk->buff_size) ? bpk->buff_size : left);
+        if (len < 0 && errno == EINTR)
+            continue;
+        else if (len <= 0 ||
+                (copy && bpk_write_fd(bpk->fd, buff, len) != 0))
+            break;
+        if (!copy)
+            bpk_cksum_update(&ctx, buff, len);
+        left -= len;
+    }
+    close(fd);
+
+    if (left != 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    else if (!copy)
+        part->crc = bpk_cksum_final(&ctx);
+    return 0;
+}
+
+/**
+ * @brief lay the streamed package out, and write it.
+ * @details headers and the table of contents are computed when out is 0,
+ * then written with the parts data when out is 1.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_stream_layout(bpk *bpk, bpk_toc_entry *toc, int out)
+{
+    bpk_stream_part *part;
+    bpk_part hdr;
+    bpk_cksum_ctx ctx;
+    unsigned char *buff = bpk_buffer(bpk);
+    size_t len, count = 0;
+    ssize_t pad;
+
+    if (buff == NULL)
+        return -1;
+
+    bpk->size = sizeof (bpk_header);
+    bpk->hcrc = BPK_CRC_SEED;
+    bpk->hlen = 0;
+    for (part = bpk->stream->head; part != NULL; part = part->next, ++count)
+    {
+        pad = bpk_pad_size(part->align, bpk->size);
+        if (pad >= 0)
+        {
+            bpk_pad_header(&hdr, pad);
+            bpk->hcrc = bpk_crc32(&hdr, sizeof (bpk_part), bpk->hcrc);
+            bpk->hlen += sizeof (bpk_part);
+            bpk->size += sizeof (bpk_part) + pad;
+            if (out && bpk_write_fd(bpk->fd, &hdr, sizeof (bpk_part)) != 0)
+                return -1;
+
+            memset(buff, 0, bpk->buff_size);
+            for (; out && pad != 0; pad -= len)
+            {
+                len = ((size_t) pad > bpk->buff_size) ?
+                    bpk->buff_size : (size_t) pad;
+                if (bpk_write_fd(bpk->fd, buff, len) != 0)
+                    return -1;
+            }
+        }
+
+        hdr.type = htobe32(part->type);
+        hdr.hw_id = htobe32(part->hw_id);
+        hdr.spare = htobe32(part->cksum);
+        hdr.size = htobe64(part->size);
+        if (part->cksum != BPK_CKSUM_CRC32)
+            bpk_need_version(bpk, BPK_VERSION_CKSUM);
+        hdr.crc = htobe32(part->crc);
+        bpk->hcrc = bpk_crc32(&hdr, sizeof (bpk_part), bpk->hcrc);
+        bpk->hlen += sizeof (bpk_part);
+        bpk->size += sizeof (bpk_part);
+
+        if (toc != NULL)
+        {
+            toc[count].type = hdr.type;
+            toc[count].hw_id = hdr.hw_id;
+            toc[count].offset = htobe64(bpk->size);
+            toc[count].size = hdr.size;
+            toc[count].crc = hdr.crc;
+            toc[count].cksum = hdr.spare;
+        }
+        bpk->size += part->size;
+
+        if (out && (bpk_write_fd(bpk->fd, &hdr, sizeof (bpk_part)) != 0 ||
+                    ((part->file != NULL) ?
+                     bpk_stream_file(bpk, part, 1) :
+                     bpk_write_fd(bpk->fd, part->data, part->size)) != 0))
+            return -1;
+    }
+
+    bpk->toc = 0;
+    if (toc != NULL)
+    {
+        len = count * sizeof (bpk_toc_entry);
+        bpk_cksum_init(&ctx, BPK_CKSUM_CRC32);
+        bpk_cksum_update(&ctx, toc, len);
+
+        hdr.type = htobe32(BPK_TYPE_TOC);
+        hdr.hw_id = 0;
+        hdr.spare = htobe32(BPK_CKSUM_CRC32);
+        hdr.size = htobe64(len);
+        hdr.crc = htobe32(bpk_cksum_final(&ctx));
+        bpk->hcrc = bpk_crc32(&hdr, sizeof (bpk_part), bpk->hcrc);
+        bpk->hlen += sizeof (bpk_part);
+        bpk->toc = bpk->size;
+        bpk->size += sizeof (bpk_part) + len;
+        bpk_need_version(bpk, BPK_VERSION_TOC);
+
+        if (out && (bpk_write_fd(bpk->fd, &hdr, sizeof (bpk_part)) != 0 ||
+                    bpk_write_fd(bpk->fd, toc, len) != 0))
+            return -1;
+    }
+    return 0;
+}
+
+int bpk_stream_end(bpk *bpk)
+{
+    bpk_stream *stream = bpk->stream;
+    bpk_stream_part *part, *next;
+    bpk_toc_entry *toc = NULL;
+    bpk_header hdr;
+    size_t count = 0;
+    int ret = 0;
+
+    if (stream == NULL || !(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -2;
+    }
+    bpk->flags &= ~FLAG_CRC;
+
+    /* input files are read a first time for their checksum */
+    for (part = stream->head; part != NULL; part = part->next, ++count)
+    {
+        if (ret == 0 && part->file != NULL &&
+                bpk_stream_file(bpk, part, 0) != 0)
+            ret = -3;
+    }
+
+    if (ret == 0 && (bpk->flags & FLAG_TOC) &&
+            (toc = malloc(count * sizeof (bpk_toc_entry) + 1)) == NULL)
+        ret = -5;
+    if (ret == 0 && bpk_stream_layout(bpk, toc, 0) != 0)
+        ret = -5;
+
+    if (ret == 0)
+    {
+        hdr.magic = htobe32(BPK_MAGIC);
+        hdr.version = htobe32(bpk->version);
+        hdr.size = htobe64(bpk->size);
+        hdr.crc = 0;
+        hdr.spare = htobe64(bpk->toc);
+        hdr.crc = htobe32(bpk_crc32_combine(
+                    bpk_crc32(&hdr, sizeof (bpk_header), BPK_CRC_SEED),
+                    bpk->hcrc, bpk->hlen));
+
+        if (bpk_write_fd(bpk->fd, &hdr, sizeof (bpk_header)) != 0 ||
+                bpk_stream_layout(bpk, toc, 1) != 0)
+            ret = -3;
+    }
+    free(toc);
+
+    for (part = stream->head; part != NULL; part = next)
+    {
+        next = part->next;
+        free(part->file);
+        free(part->data);
+        free(part);
+    }
+    stream->head = NULL;
+    stream->tail = &stream->head;
+    stream->buffered = 0;
+    return ret;
+}
+
+int bpk_write_custom(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_fill_func func,
+        void *func_arg)
+{
+    return bpk_write_sized(bpk, type, hw_id, BPK_SIZE_UNKNOWN,
+            func, func_arg);
+}
+
+/**
+ * @brief bpk_write_sized adapter, lending the I/O buffer filled by a
+ * bpk_fill_func.
+ */
+typedef struct {
+    bpk *bpk;
+    bpk_fill_func func;
+    void *arg;
+} bpk_fill_lend;
+
+static ssize_t bpk_lend_buffer(const void **buf, void *arg)
+{
+    bpk_fill_lend *fl = arg;
+
+    *buf = fl->bpk->buff;
+    return fl->func(fl->bpk->buff, fl->bpk->buff_size, fl->arg);
+}
+
+/**
+ * @brief streamed bpk_write_lend adapter, copying the lent data.
+ * @details streamed parts are buffered anyway.
+ */
+typedef struct {
+    bpk_lend_func func;
+    void *arg;
+    const unsigned char *data; /**!< lent data left to copy */
+    size_t len;
+} bpk_lend_fill;
+
+static ssize_t bpk_fill_lent(void *buf, size_t count, void *arg)
+{
+    bpk_lend_fill *lf = arg;
+    const void *data;
+    ssize_t len;
+
+    if (lf->len == 0)
+    {
+        len = lf->func(&data, lf->arg);
+        if (len <= 0)
+            return len;
+        lf->data = data;
+        lf->len = len;
+    }
+    if (count > lf->len)
+        count = lf->len;
+    memcpy(buf, lf->data, count);
+    lf->data += count;
+    lf->len -= count;
+    return count;
+}
+
+/**
+ * @brief write a part from the chunks of a bpk_lend_func.
+ * @param[in] size the part size, BPK_SIZE_UNKNOWN if not known.
+ */
+static int bpk_write_chunks(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size size,
+        bpk_lend_func func,
+        void *func_arg)
+{
+    const void *buf;
+    ssize_t len;
+    bpk_part part;
+    bpk_cksum_ctx ctx;
+    bpk_sparse *sp = NULL;
+    int ret = 0;
+
+    if ((bpk->flags & FLAG_SPARSE) &&
+            (sp = calloc(1, sizeof (bpk_sparse))) == NULL)
+        return -5;
+
+    if (bpk_part_begin(bpk, type, hw_id, size, &part, &ctx) != 0)
+        ret = -2;
+
+    while (ret == 0 && (len = func(&buf, func_arg)) > 0)
+    {
+        if (bpk_part_data(bpk, &part, &ctx, sp, buf, len) != 0)
+            ret = -3;
+    }
+    if (ret == 0 && (len < 0 || (size != BPK_SIZE_UNKNOWN &&
+                    ((sp != NULL) ? sp->size : part.size) != size)))
+    {
+        errno = EIO;
+        ret = -4;
+    }
+
+    if (ret == 0 && ((sp != NULL && bpk_sparse_end(bpk, &part, sp) != 0) ||
+                bpk_part_end(bpk, &part, &ctx) != 0))
+        ret = -3;
+    bpk_sparse_free(sp);
+    return ret;
+}
+
+int bpk_write_sized(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size size,
+        bpk_fill_func func,
+        void *func_arg)
+{
+    bpk_fill_lend fl = { bpk, func, func_arg };
+
+    if (bpk->stream != NULL)
+        return bpk_stream_add(bpk, type, hw_id, NULL, size, func, func_arg);
+    else if (bpk_buffer(bpk) == NULL)
+        return -5;
+    return bpk_write_chunks(bpk, type, hw_id, size, bpk_lend_buffer, &fl);
+}
+
+int bpk_write_lend(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_lend_func func,
+        void *func_arg)
+{
+    bpk_lend_fill lf = { func, func_arg, NULL, 0 };
+
+    if (bpk->stream != NULL)
+        return bpk_stream_add(bpk, type, hw_id, NULL, BPK_SIZE_UNKNOWN,
+                bpk_fill_lent, &lf);
+    return bpk_write_chunks(bpk, type, hw_id, BPK_SIZE_UNKNOWN,
+            func, func_arg);
+}
+
+#define BPK_COPY_RANGE 0 /* copy_file_range */
+#define BPK_COPY_SENDFILE 1 /* sendfile */
+#define BPK_COPY_BUFFERED 2 /* done in user-space by the caller */
+/* in-kernel copies need a file descriptor */
+#define BPK_COPY_FIRST(bpk) (((bpk)->fd >= 0) ? BPK_COPY_RANGE : BPK_COPY_BUFFERED)
+
+/**
+ * @brief copy some data between two files in-kernel.
+ * @details mode is updated when a method is not supported, so that it's not
+ * retried, once it reaches BPK_COPY_BUFFERED the remaining data must be
+ * copied by the caller.
+ *
+ * @param[in] fd_in the input file.
+ * @param[in,out] in_off offset in the input file.
+ * @param[in] fd_out the output file.
+ * @param[in,out] out_off offset in the output file.
+ * @param[in,out] len length to copy, updated with the remaining length.
+ * @param[in,out] mode the BPK_COPY_* method to use.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_copy_fd(
+        int fd_in,
+        off_t *in_off,
+        int fd_out,
+        off_t *out_off,
+        bpk_size *len,
+        int *mode)
+{
+    ssize_t ret;
+    size_t count;
+
+    while (*len != 0)
+    {
+        /* size_t may be narrower than the partition size */
+        count = (*len > BPK_COPY_MAX) ? BPK_COPY_MAX : *len;
+
+        switch (*mode)
+        {
+#if defined(HAVE_COPY_FILE_RANGE)
+        case BPK_COPY_RANGE:
+            ret = copy_file_range(fd_in, in_off, fd_out, out_off, count, 0);
+            if (ret > 0)
+                *len -= ret;
+            break;
+#endif
+#if defined(HAVE_SYS_SENDFILE)
+        case BPK_COPY_SENDFILE:
+            ret = -1;
+            if (lseek(fd_out, *out_off, SEEK_SET) == *out_off)
+            {
+                ret = sendfile(fd_out, fd_in, in_off, count);
+                if (ret > 0)
+                {
+                    *out_off += ret;
+                    *len -= ret;
+                }
+            }
+            break;
+#endif
+        case BPK_COPY_BUFFERED:
+            return 0;
+        default:
+            ++(*mode);
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        else if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+                    errno == EINVAL || errno == EOPNOTSUPP))
+            ++(*mode);
+        else if (ret <= 0)
+        {
+            if (ret == 0)
+                errno = EIO; /* input file truncated */
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief write a partition from a mapped input file.
+ * @details the checksum is computed on the mapping while the data itself is
+ * copied by the kernel, chunk by chunk to keep the data hot in cache.
+ * When sp is not NULL only its extents are copied, holes are checksummed as
+ * zeros without being read.
+ * fd_in is closed, map unmapped and sp released.
+ */
+static int bpk_write_mapped(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        int fd_in,
+        const unsigned char *map,
+        size_t size,
+        bpk_sparse *sp)
+{
+    bpk_part part;
+    bpk_cksum_ctx ctx;
+    size_t i, len, count = (sp != NULL) ? sp->count : 1;
+    bpk_size ext_off, ext_size, done, left, pos = 0;
+    off_t in_off, out_off;
+    int mode = BPK_COPY_FIRST(bpk);
+    int ret = 0;
+
+    if (bpk_part_begin(bpk, type, hw_id, size, &part, &ctx) != 0)
+        ret = -2;
+
+    /* in-kernel copies don't go through bpk_pwrite */
+    bpk->win_len = 0;
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+    for (i = 0; ret == 0 && i < count; ++i)
+    {
+        ext_off = (sp != NULL) ? sp->ext[i].offset : 0;
+        ext_size = (sp != NULL) ? sp->ext[i].size : size;
+        if (ext_off > pos)
+            bpk_cksum_zeros(&ctx, ext_off - pos);
+
+        for (done = 0; ret == 0 && done < ext_size; done += len)
+        {
+            len = ext_size - done;
+            len = (len > BPK_COPY_CHUNK) ? BPK_COPY_CHUNK : len;
+
+            in_off = ext_off + done;
+            out_off = bpk->size;
+            left = len;
+
+            bpk_cksum_update(&ctx, map + in_off, len);
+            if (bpk_copy_fd(fd_in, &in_off, bpk->fd, &out_off, &left,
+                        &mode) != 0 ||
+                    (left != 0 &&
+                     bpk_pwrite(bpk, map + in_off, left, out_off) != 0))
+                ret = -3;
+            else
+            {
+                part.size += len;
+                bpk->size += len;
+            }
+        }
+        pos = ext_off + ext_size;
+    }
+    munmap((void *) map, size);
+    close(fd_in);
+
+    if (ret == 0 && sp != NULL)
+    {
+        bpk_cksum_zeros(&ctx, size - pos);
+        if (bpk_sparse_end(bpk, &part, sp) != 0)
+            ret = -3;
+    }
+    bpk_sparse_free(sp);
+
+    if (ret == 0 && bpk_part_end(bpk, &part, &ctx) != 0)
+        ret = -3;
+    return ret;
+}
+
+int bpk_write(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        const char *file)
+{
+    unsigned char *buff;
+    ssize_t len;
+    int fd_in;
+    bpk_part part;
+    bpk_cksum_ctx ctx;
+    struct stat st;
+    const unsigned char *map = NULL;
+    bpk_sparse *sp = NULL;
+    bpk_size size = BPK_SIZE_UNKNOWN;
+    int ret = 0;
+
+    if (bpk->stream != NULL)
+        return bpk_stream_write(bpk, type, hw_id, file);
+
+    fd_in = open(file, O_RDONLY);
+    if (fd_in < 0)
+        return -1;
+
+    if (fstat(fd_in, &st) == 0 && S_ISREG(st.st_mode))
+        size = st.st_size;
+    if (size != BPK_SIZE_UNKNOWN && bpk_mappable(st.st_size))
+    {
+        if (bpk->flags & FLAG_SPARSE)
+            sp = bpk_file_extents(fd_in, st.st_size);
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd_in, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+    if (map != NULL)
+        return bpk_write_mapped(bpk, type, hw_id, fd_in, map, st.st_size, sp);
+    bpk_sparse_free(sp);
+
+    /* streamed input, holes are found by scanning for zero blocks */
+    sp = NULL;
+    buff = bpk_buffer(bpk);
+    if (buff == NULL ||
+            ((bpk->flags & FLAG_SPARSE) &&
+             (sp = calloc(1, sizeof (bpk_sparse))) == NULL))
+    {
+        close(fd_in);
+        return -5;
+    }
+
+    if (bpk_part_begin(bpk, type, hw_id, size, &part, &ctx) != 0)
+    {
+        close(fd_in);
+        bpk_sparse_free(sp);
+        return -2;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while ((len = read(fd_in, buff, bpk->buff_size)) != 0)
+    {
+        if (len < 0 && errno == EINTR)
+            continue;
+        else if (len < 0)
+        {
+            errno = EIO;
+            ret = -4;
+            break;
+        }
+
+        if (bpk_part_data(bpk, &part, &ctx, sp, buff, len) != 0)
+        {
+            ret = -3;
+            break;
+        }
+    }
+    close(fd_in);
+
+    if (ret == 0 && ((sp != NULL && bpk_sparse_end(bpk, &part, sp) != 0) ||
+                bpk_part_end(bpk, &part, &ctx) != 0))
+        ret = -3;
+    bpk_sparse_free(sp);
+    return ret;
+}
+
+/**
+ * @brief read the next partition description.
+ */
+static int bpk_read_part(bpk *bpk, bpk_index_entry *entry)
+{
+    if (bpk->index != NULL)
+    {
+        if (bpk->pidx >= bpk->index->count)
+            return -1;
+        *entry = bpk->index->parts[bpk->pidx];
+    }
+    else
+    {
+        do
+        {
+            if (bpk_read_part_at(bpk, bpk->next, entry) != 0)
+                return -1;
+            bpk->next = entry->offset + entry->size;
+        } while (bpk_type_hidden(entry->type));
+    }
+
+    ++bpk->pidx;
+    return 0;
+}
+
+/**
+ * @brief make a partition the current one.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the extent table of a sparse partition is invalid.
+ */
+static int bpk_select(
+        bpk *bpk,
+        const bpk_index_entry *entry,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id)
+{
+    bpk_sparse *sp = NULL;
+
+    if (entry->sparse &&
+            (sp = bpk_sparse_load(bpk, entry->offset, entry->size)) == NULL)
+        return -1;
+    bpk_sparse_free(bpk->psparse);
+    bpk->psparse = sp;
+
+    bpk->poff = entry->offset;
+    bpk->next = entry->offset + entry->size;
+    bpk->ppos = 0;
+    bpk->psize = (sp != NULL) ? sp->size : entry->size;
+    bpk->pcksum = entry->cksum;
+    bpk->pcrc = entry->crc;
+
+    if (size != NULL)
+        *size = bpk->psize;
+    if (crc != NULL)
+        *crc = entry->crc;
+    if (hw_id != NULL)
+        *hw_id = entry->hw_id;
+    return 0;
+}
+
+int bpk_find(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size *size,
+        uint32_t *crc)
+{
+    bpk_index_entry entry;
+    ssize_t pos;
+
+    bpk_rewind(bpk);
+
+    if (bpk->index != NULL)
+    {
+        pos = bpk_index_find(bpk->index, type, hw_id);
+        if (pos >= 0)
+        {
+            bpk->pidx = pos + 1;
+            if (bpk_select(bpk, &bpk->index->parts[pos], size, crc,
+                        NULL) == 0)
+                return 0;
+        }
+    }
+    else
+    {
+        while (bpk_read_part(bpk, &entry) == 0)
+        {
+            if (entry.type == type && entry.hw_id == hw_id)
+            {
+                if (bpk_select(bpk, &entry, size, crc, NULL) == 0)
+                    return 0;
+                break;
+            }
+        }
+    }
+    bpk->ppos = bpk->psize = 0;
+    return -1;
+}
+
+bpk_type bpk_next(
+        bpk *bpk,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id)
+{
+    bpk_index_entry entry;
+
+    if (bpk_read_part(bpk, &entry) == 0 &&
+            bpk_select(bpk, &entry, size, crc, hw_id) == 0)
+        return entry.type;
+    bpk->ppos = bpk->psize = 0;
+    return BPK_TYPE_INVALID;
+}
+
+ssize_t bpk_count(bpk *bpk)
+{
+    if (bpk_build_index(bpk) != 0)
+        return -1;
+    return bpk->index->count;
+}
+
+bpk_type bpk_part_at(
+        bpk *bpk,
+        size_t index,
         bpk_size *size,
         uint32_t *crc,
         uint32_t *hw_id)
 {
-    bpk_part part;
+    if (bpk_build_index(bpk) != 0 || index >= bpk->index->count ||
+            bpk_select(bpk, &bpk->index->parts[index], size, crc,
+                hw_id) != 0)
+    {
+        bpk->ppos = bpk->psize = 0;
+        return BPK_TYPE_INVALID;
+    }
+
+    bpk->pidx = index + 1;
+    return bpk->index->parts[index].type;
+}
+
+void bpk_rewind(bpk *bpk)
+{
+    bpk->next = sizeof (bpk_header);
+    bpk->pidx = 0;
+    bpk->ppos = bpk->psize = bpk->poff = 0;
+    bpk_sparse_free(bpk->psparse);
+    bpk->psparse = NULL;
+}
+
+/**
+ * @brief compute the checksum of a partition data.
+ * @details doesn't modify bpk, so that it can be used from cursors.
+ *
+ * @param[in] bpk the bpk file.
+ * @param[in] sp the extents of a sparse partition, NULL otherwise.
+ * @param[in] off the data offset.
+ * @param[in] psize the data size.
+ * @param[in] algo the checksum algorithm.
+ * @param[in] buff the read buffer.
+ * @param[in] buff_size the size of buff.
+ * @return the checksum or 0xFFFFFFFF on error.
+ */
+static uint32_t bpk_data_cksum(
+        bpk *bpk,
+        const bpk_sparse *sp,
+        off_t off,
+        bpk_size psize,
+        bpk_cksum algo,
+        unsigned char *buff,
+        size_t buff_size)
+{
+    bpk_size size;
+    ssize_t len;
+    const void *ptr;
+    bpk_cksum_ctx ctx;
+    bpk_sparse_pos sp_pos = { 0, 0, 0 };
+
+    if (buff == NULL || bpk_cksum_init(&ctx, algo) != 0)
+        return 0xFFFFFFFF;
+
+    /* only the stored extents are read, holes are fed as zeros */
+    if (sp != NULL)
+        psize = (sp->count == 0) ? 0 :
+            sp->ext[sp->count - 1].data + sp->ext[sp->count - 1].size;
+
+    bpk_advise(bpk, off, psize, MADV_SEQUENTIAL);
+    for (size = psize; size != 0; )
+    {
+        len = (bpk->map != NULL || size < buff_size) ? size : buff_size;
+
+        len = bpk_peek(bpk, buff, len, off + (psize - size), &ptr);
+        if (len <= 0)
+            break;
+
+        size -= len;
+        if (sp != NULL)
+            bpk_sparse_cksum(&ctx, sp, &sp_pos, ptr, len);
+        else
+            bpk_cksum_update(&ctx, ptr, len);
+    }
+    if (sp != NULL)
+        bpk_sparse_cksum_end(&ctx, sp, &sp_pos);
+
+    return (size == 0) ? bpk_cksum_final(&ctx) : 0xFFFFFFFF;
+}
+
+uint32_t bpk_compute_data_crc(bpk *bpk)
+{
+    return bpk_data_cksum(bpk, bpk->psparse, bpk->poff, bpk->psize,
+            bpk->pcksum, bpk_buffer(bpk), bpk->buff_size);
+}
+
+typedef struct {
+    pthread_t tid;
+    int started;
+    const unsigned char *map;
+    int fd;
+    off_t offset;
+    bpk_size size;
+    bpk_size len;
+    bpk_cksum algo;
+    uint32_t crc;
+} bpk_crc_range;
+
+static void *bpk_crc_range_worker(void *arg)
+{
+    bpk_crc_range *range = arg;
+    bpk_cksum_ctx ctx;
+    ssize_t len;
+    char *buff;
+
+    bpk_cksum_init(&ctx, range->algo);
+    if (range->map != NULL)
+    {
+        bpk_cksum_update(&ctx, range->map + range->offset, range->size);
+        range->crc = bpk_cksum_final(&ctx);
+        range->size = 0;
+        return NULL;
+    }
+
+    buff = malloc(BPK_MT_BUFF_SIZE);
+    if (buff == NULL)
+        return NULL;
+
+    while (range->size != 0)
+    {
+        len = (range->size > BPK_MT_BUFF_SIZE) ? BPK_MT_BUFF_SIZE : range->size;
+
+        len = pread(range->fd, buff, len, range->offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+        else if (len <= 0)
+            break;
+
+        bpk_cksum_update(&ctx, buff, len);
+        range->offset += len;
+        range->size -= len;
+    }
+    range->crc = bpk_cksum_final(&ctx);
+    free(buff);
+    return NULL;
+}
+
+uint32_t bpk_compute_data_crc_mt(bpk *bpk, unsigned int threads)
+{
+    bpk_crc_range *ranges;
+    bpk_cksum_combine_func combine;
+    bpk_size chunk;
+    off_t start;
+    unsigned int i;
+    uint32_t crc = BPK_CRC_SEED;
+    int err = 0;
+
+    /* threads read the file directly, other backends are read serially */
+    combine = bpk_cksum_combiner(bpk->pcksum);
+    if (combine == NULL || bpk->psparse != NULL ||
+            (bpk->map == NULL && bpk->fd < 0))
+        return bpk_compute_data_crc(bpk);
+
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? cpus : 1;
+    }
+    if ((bpk_size) threads > (bpk_size) bpk->psize / BPK_MT_MIN_RANGE)
+        threads = (bpk_size) bpk->psize / BPK_MT_MIN_RANGE;
+    if (threads <= 1)
+        return bpk_compute_data_crc(bpk);
+
+    ranges = malloc(threads * sizeof (bpk_crc_range));
+    if (ranges == NULL)
+        return 0xFFFFFFFF;
+
+    start = bpk->poff;
+    chunk = bpk->psize / threads;
+
+    if (bpk->map != NULL &&
+            (bpk_size) (start + bpk->psize) > bpk->map_size)
+    {
+        free(ranges);
+        return 0xFFFFFFFF;
+    }
+    bpk_advise(bpk, start, bpk->psize, MADV_WILLNEED);
+
+    for (i = 0; i < threads; ++i)
+    {
+        ranges[i].map = bpk->map;
+        ranges[i].fd = bpk->fd;
+        ranges[i].offset = start + i * chunk;
+        ranges[i].len = (i == threads - 1) ?
+            (bpk_size) bpk->psize - i * chunk : chunk;
+        ranges[i].size = ranges[i].len;
+        ranges[i].algo = bpk->pcksum;
+        ranges[i].crc = BPK_CRC_SEED;
+    }
+
+    /* last range is computed by the calling thread */
+    for (i = 0; i < threads - 1; ++i)
+    {
+        ranges[i].started = (pthread_create(&ranges[i].tid, NULL,
+                    bpk_crc_range_worker, &ranges[i]) == 0);
+        if (!ranges[i].started)
+            bpk_crc_range_worker(&ranges[i]);
+    }
+    ranges[threads - 1].started = 0;
+    bpk_crc_range_worker(&ranges[threads - 1]);
+
+    for (i = 0; i < threads; ++i)
+    {
+        if (ranges[i].started)
+            pthread_join(ranges[i].tid, NULL);
+
+        if (ranges[i].size != 0)
+            err = 1;
+        crc = combine(crc, ranges[i].crc, ranges[i].len);
+    }
+    free(ranges);
+    return (err) ? 0xFFFFFFFF : crc;
+}
+
+/**
+ * @brief read some data in a sparse partition, holes are read as zeros.
+ * @return the number of bytes read, 0 on error (setting errno).
+ */
+static bpk_size bpk_sparse_read(
+        bpk *bpk,
+        const bpk_sparse *sp,
+        off_t poff,
+        bpk_size pos,
+        unsigned char *buf,
+        bpk_size size)
+{
+    size_t i = bpk_sparse_find(sp, pos);
+    bpk_size done, len, end;
+
+    for (done = 0; done < size; done += len, pos += len)
+    {
+        end = (i < sp->count) ? sp->ext[i].offset : sp->size;
+        if (pos < end)
+        {
+            len = (end - pos < size - done) ? end - pos : size - done;
+            memset(buf + done, 0, len);
+            continue;
+        }
+
+        end = sp->ext[i].offset + sp->ext[i].size;
+        len = (end - pos < size - done) ? end - pos : size - done;
+        if (bpk_pread(bpk, buf + done, len,
+                    poff + sp->ext[i].data + (pos - sp->ext[i].offset)) !=
+                (ssize_t) len)
+        {
+            errno = EIO;
+            return 0;
+        }
+        if (pos + len == end)
+            ++i;
+    }
+    return size;
+}
+
+/**
+ * @brief read some data in the current partition.
+ * @return the number of bytes read, 0 on error (setting errno).
+ */
+static bpk_size bpk_data_read(
+        bpk *bpk,
+        const bpk_sparse *sp,
+        off_t poff,
+        off_t psize,
+        off_t *ppos,
+        void *buf,
+        bpk_size size)
+{
+    ssize_t len;
+
+    if (size > (bpk_size) (psize - *ppos))
+        size = psize - *ppos;
+
+    if (size <= 0)
+        return 0;
+
+    if (sp != NULL)
+        len = bpk_sparse_read(bpk, sp, poff, *ppos, buf, size);
+    else
+        len = bpk_pread(bpk, buf, size, poff + *ppos);
+    if (len < 0)
+    {
+        errno = EIO;
+        return 0;
+    }
+
+    *ppos += len;
+    return len;
+}
+
+bpk_size bpk_read(bpk *bpk, void *buf, bpk_size size)
+{
+    return bpk_data_read(bpk, bpk->psparse, bpk->poff, bpk->psize,
+            &bpk->ppos, buf, size);
+}
+
+int bpk_read_custom(
+        bpk *bpk,
+        bpk_drain_func func,
+        void *func_arg,
+        int flags)
+{
+    unsigned char *buff;
+    const void *ptr;
+    ssize_t len;
+    size_t chunk;
+    bpk_size size;
+    bpk_cksum_ctx ctx;
+    int check = (bpk->ppos == 0 && !(flags & BPK_READ_NOCHECK));
+
+    /* the checksum covers the whole partition */
+    if (check && bpk_cksum_init(&ctx, bpk->pcksum) != 0)
+    {
+        errno = EINVAL;
+        return -2;
+    }
+
+    buff = bpk_buffer(bpk);
+    if (buff == NULL)
+    {
+        errno = ENOMEM;
+        return -2;
+    }
+
+    if (bpk->psparse == NULL)
+        bpk_advise(bpk, bpk->poff + bpk->ppos, bpk->psize - bpk->ppos,
+                MADV_SEQUENTIAL);
+    while (bpk->ppos < bpk->psize)
+    {
+        size = bpk->psize - bpk->ppos;
+        if (bpk->psparse != NULL)
+        {
+            /* holes are read as zeros */
+            ptr = buff;
+            len = bpk_read(bpk, buff,
+                    (size < bpk->buff_size) ? size : bpk->buff_size);
+        }
+        else
+        {
+            /* chunked on mappings too, the checksum keeps data hot */
+            chunk = (bpk->map != NULL) ? BPK_COPY_CHUNK : bpk->buff_size;
+            len = bpk_peek(bpk, buff, (size < chunk) ? (size_t) size : chunk,
+                    bpk->poff + bpk->ppos, &ptr);
+            if (len > 0)
+                bpk->ppos += len;
+        }
+        if (len <= 0)
+        {
+            errno = EIO;
+            return -3;
+        }
+
+        if (check)
+            bpk_cksum_update(&ctx, ptr, len);
+        if (func(ptr, len, func_arg) < 0)
+            return -4;
+    }
+
+    if (check && bpk_cksum_final(&ctx) != bpk->pcrc)
+    {
+        errno = EBADMSG;
+        return -5;
+    }
+    return 0;
+}
+
+/**
+ * @brief reflink the current partition data at the beginning of a file.
+ * @details this only works when both files are on the same (reflink capable)
+ * filesystem, and on filesystem block boundaries, the unaligned tail of the
+ * partition is left for the caller.
+ *
+ * @return the length cloned, 0 if the data could not be cloned.
+ */
+static bpk_size bpk_clone_range(bpk *bpk, int fd_out, bpk_size len)
+{
+#if defined(FICLONERANGE)
+    struct file_clone_range range;
+    struct stat st;
+    off_t off = bpk->poff + bpk->ppos;
+
+    if (fstat(bpk->fd, &st) != 0 || st.st_blksize <= 0 ||
+            (off % st.st_blksize) != 0)
+        return 0;
+
+    /* the last block may be partial when it ends the source file */
+    if (off + (off_t) len != st.st_size)
+        len -= len % st.st_blksize;
+    if (len == 0)
+        return 0;
+
+    range.src_fd = bpk->fd;
+    range.src_offset = off;
+    range.src_length = len;
+    range.dest_offset = 0;
+    return (ioctl(fd_out, FICLONERANGE, &range) == 0) ? len : 0;
+#else
+    (void) bpk;
+    (void) fd_out;
+    (void) len;
+    return 0;
+#endif
+}
+
+/**
+ * @brief extract the current sparse partition, recreating its holes.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error.
+ */
+static int bpk_read_file_sparse(bpk *bpk, int fd_out, unsigned char *buff)
+{
+    const bpk_sparse *sp = bpk->psparse;
+    bpk_size start = bpk->ppos, pos;
+    const void *ptr;
+    ssize_t len;
+    size_t i;
+    bpk_size left;
+    off_t in_off, out_off;
+    int mode = BPK_COPY_FIRST(bpk);
+
+    for (i = bpk_sparse_find(sp, start); i < sp->count; ++i)
+    {
+        pos = (sp->ext[i].offset > start) ? sp->ext[i].offset : start;
+        in_off = bpk->poff + sp->ext[i].data + (pos - sp->ext[i].offset);
+        out_off = pos - start;
+        left = sp->ext[i].offset + sp->ext[i].size - pos;
+
+        if (bpk_copy_fd(bpk->fd, &in_off, fd_out, &out_off, &left,
+                    &mode) != 0)
+            return -1;
+
+        while (left != 0)
+        {
+            len = (bpk->map != NULL || left < bpk->buff_size) ?
+                left : bpk->buff_size;
+
+            len = bpk_peek(bpk, buff, len, in_off, &ptr);
+            if (len <= 0 || bpk_pwrite_fd(fd_out, ptr, len, out_off) != 0)
+                return -1;
+            in_off += len;
+            out_off += len;
+            left -= len;
+        }
+    }
+
+    /* holes are left unwritten, the file size covers the trailing one */
+    return ftruncate(fd_out, sp->size - start);
+}
+
+int bpk_read_file(bpk *bpk, const char *file)
+{
+    int fd_out;
+    unsigned char *buff;
+    const void *ptr;
+    ssize_t len;
+    bpk_size left;
+    off_t in_off, out_off;
+    int mode = BPK_COPY_FIRST(bpk);
+    bpk_size size = bpk->psize - bpk->ppos;
+
+    fd_out = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd_out < 0)
+        return -1;
+
+    buff = bpk_buffer(bpk);
+    if (buff == NULL)
+    {
+        close(fd_out);
+        return -2;
+    }
+
+    if (bpk->psparse != NULL)
+    {
+        if (bpk_read_file_sparse(bpk, fd_out, buff) != 0)
+        {
+            close(fd_out);
+            errno = EIO;
+            return -3;
+        }
+        out_off = size = 0;
+    }
+    else
+    {
+        /* reflink, then in-kernel copy, then buffered copy */
+        out_off = bpk_clone_range(bpk, fd_out, size);
+        in_off = bpk->poff + bpk->ppos + out_off;
+        left = size - out_off;
+        if (bpk_copy_fd(bpk->fd, &in_off, fd_out, &out_off, &left,
+                    &mode) != 0)
+        {
+            close(fd_out);
+            errno = EIO;
+            return -3;
+        }
+        bpk->ppos += size - left;
+        size = left;
+    }
+
+    bpk_advise(bpk, bpk->poff + bpk->ppos, size, MADV_SEQUENTIAL);
+    while (size != 0)
+    {
+        len = (bpk->map != NULL || size < bpk->buff_size) ?
+            size : bpk->buff_size;
+
+        len = bpk_peek(bpk, buff, len, bpk->poff + bpk->ppos, &ptr);
+        if (len <= 0)
+            break;
+
+        if (bpk_pwrite_fd(fd_out, ptr, len, out_off) != 0)
+        {
+            close(fd_out);
+            errno = EIO;
+            return -3;
+        }
+        size -= len;
+        bpk->ppos += len;
+        out_off += len;
+    }
+    if (close(fd_out) != 0)
+    {
+        errno = EIO;
+        return -4;
+    }
+    bpk->ppos = bpk->psize = 0;
+    return 0;
+}
+
+/**
+ * @brief O_DIRECT writer, writes alternate between two aligned slots so
+ * that the next block is read while the previous one is written.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    unsigned char *buff[2];
+    size_t len[2]; /* bytes to write, 0 once the slot is free */
+    off_t off[2];
+    int done;
+    int err;
+} bpk_direct_writer;
+
+static void *bpk_direct_worker(void *arg)
+{
+    bpk_direct_writer *w = arg;
+    int slot = 0, err;
+    size_t len;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        while (w->len[slot] == 0 && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        len = w->len[slot];
+        pthread_mutex_unlock(&w->lock);
+        if (len == 0)
+            break;
+
+        err = bpk_pwrite_fd(w->fd, w->buff[slot], len, w->off[slot]);
+
+        pthread_mutex_lock(&w->lock);
+        if (err != 0 && w->err == 0)
+            w->err = errno;
+        w->len[slot] = 0;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        slot ^= 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief read an aligned block for bpk_read_file_direct.
+ * @details O_DIRECT reads may be refused or cut short on some filesystems
+ * and at the end of file, missing bytes are then read through the page
+ * cache.
+ * @param[in] len aligned length to read.
+ * @param[in] need number of bytes that must be read.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error.
+ */
+static int bpk_direct_read(
+        bpk *bpk,
+        int fd,
+        unsigned char *buf,
+        size_t len,
+        size_t need,
+        off_t off)
+{
+    ssize_t rlen;
+
+    do
+        rlen = pread(fd, buf, len, off);
+    while (rlen < 0 && errno == EINTR);
+
+    if (rlen < 0)
+        rlen = 0;
+    if ((size_t) rlen >= need)
+        return 0;
+    return (bpk_pread(bpk, buf + rlen, need - rlen, off + rlen) ==
+            (ssize_t) (need - rlen)) ? 0 : -1;
+}
+
+int bpk_read_file_direct(bpk *bpk, const char *file, size_t block)
+{
+    int fd_in, fd_out, slot = 0, ret = 0, check, err = 0;
+    char path[32];
+    void *buff = NULL, *stage = NULL;
+    unsigned char *dst;
+    bpk_direct_writer w;
+    pthread_t th;
+    bpk_cksum_ctx ctx;
+    off_t src, out_off = 0;
+    size_t shift, len, alen;
+    bpk_size size = bpk->psize - bpk->ppos;
+
+    if (block == 0)
+        block = BPK_DIRECT_BLOCK;
+    else if (block % BPK_DIRECT_ALIGN != 0)
+    {
+        errno = EINVAL;
+        return -2;
+    }
+
+    /* the checksum covers the whole partition */
+    check = (bpk->ppos == 0);
+    if (check && bpk_cksum_init(&ctx, bpk->pcksum) != 0)
+    {
+        errno = EINVAL;
+        return -2;
+    }
+
+    if (bpk->psparse != NULL)
+    {
+        /* checked first, holes are recreated by bpk_read_file */
+        if (check && bpk_compute_data_crc(bpk) != bpk->pcrc)
+        {
+            errno = EBADMSG;
+            return -5;
+        }
+        return bpk_read_file(bpk, file);
+    }
+
+    src = bpk->poff + bpk->ppos;
+    shift = src % BPK_DIRECT_ALIGN;
+    if (posix_memalign(&buff, BPK_DIRECT_ALIGN, 2 * block) != 0 ||
+            (shift != 0 && posix_memalign(&stage, BPK_DIRECT_ALIGN,
+                                          block + BPK_DIRECT_ALIGN) != 0))
+    {
+        free(buff);
+        errno = ENOMEM;
+        return -2;
+    }
+
+    fd_out = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (fd_out < 0 && errno == EINVAL) /* not supported by the filesystem */
+        fd_out = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd_out < 0)
+    {
+        free(stage);
+        free(buff);
+        return -1;
+    }
+
+    /* a second open file description, not to change bpk->fd flags */
+    snprintf(path, sizeof (path), "/proc/self/fd/%d", bpk->fd);
+    fd_in = open(path, O_RDONLY | O_DIRECT);
+    if (fd_in < 0)
+        fd_in = bpk->fd;
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.fd = fd_out;
+    w.buff[0] = buff;
+    w.buff[1] = (unsigned char *) buff + block;
+    w.len[0] = w.len[1] = 0;
+    w.done = w.err = 0;
+    if ((err = pthread_create(&th, NULL, bpk_direct_worker, &w)) != 0)
+    {
+        ret = -2;
+        size = 0;
+    }
+
+    while (size != 0)
+    {
+        len = (size < block) ? size : block;
+
+        pthread_mutex_lock(&w.lock);
+        while (w.len[slot] != 0 && w.err == 0)
+            pthread_cond_wait(&w.cond, &w.lock);
+        err = w.err;
+        pthread_mutex_unlock(&w.lock);
+        if (err != 0)
+            break;
+
+        /* unaligned data is staged, then moved to an aligned slot */
+        dst = (shift == 0) ? w.buff[slot] : stage;
+        alen = (shift + len + BPK_DIRECT_ALIGN - 1) & ~(BPK_DIRECT_ALIGN - 1);
+        if (bpk_direct_read(bpk, fd_in, dst, alen, shift + len,
+                    src - shift) != 0)
+        {
+            ret = -3;
+            break;
+        }
+        if (shift != 0)
+            memcpy(w.buff[slot], (unsigned char *) stage + shift, len);
+
+        if (check)
+            bpk_cksum_update(&ctx, w.buff[slot], len);
+
+        /* the tail block is padded, the file is truncated afterwards */
+        alen = (len + BPK_DIRECT_ALIGN - 1) & ~(BPK_DIRECT_ALIGN - 1);
+        memset(w.buff[slot] + len, 0, alen - len);
+
+        pthread_mutex_lock(&w.lock);
+        w.off[slot] = out_off;
+        w.len[slot] = alen;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+
+        src += len;
+        out_off += len;
+        size -= len;
+        slot ^= 1;
+    }
+
+    if (ret != -2)
+    {
+        pthread_mutex_lock(&w.lock);
+        w.done = 1;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+        pthread_join(th, NULL);
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+
+    if (fd_in != bpk->fd)
+        close(fd_in);
+    free(stage);
+    free(buff);
+
+    if (ret == 0 && (w.err != 0 || ftruncate(fd_out, out_off) != 0))
+        ret = -3;
+    if (close(fd_out) != 0 && ret == 0)
+        ret = -4;
+    if (ret == -2)
+    {
+        errno = err;
+        return ret;
+    }
+    else if (ret != 0)
+    {
+        errno = EIO;
+        return ret;
+    }
+
+    bpk->ppos = bpk->psize = 0;
+    if (check && bpk_cksum_final(&ctx) != bpk->pcrc)
+    {
+        errno = EBADMSG;
+        return -5;
+    }
+    return 0;
+}
+
+/**
+ * @brief find a partition to edit, in file order.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the partition doesn't exist.
+ */
+static int bpk_locate(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_index_entry *entry)
+{
+    int ret = -1;
+
+    bpk_rewind(bpk);
+    while (bpk_read_part(bpk, entry) == 0)
+    {
+        if (entry->type == type && entry->hw_id == hw_id)
+        {
+            ret = 0;
+            break;
+        }
+    }
+    bpk_rewind(bpk);
+    return ret;
+}
+
+/**
+ * @brief drop the state depending on the partitions layout after an
+ * in-place edit, the header crc is then recomputed when closing the file.
+ */
+static void bpk_edited(bpk *bpk)
+{
+    bpk_index_free(bpk->index);
+    bpk->index = NULL;
+    bpk->win_len = 0;
+    bpk->flags &= ~FLAG_HCRC;
+    bpk_rewind(bpk);
+}
 
-    if (bpk->psize != 0)
-        fseek(bpk->fd, bpk->psize - bpk->ppos, SEEK_CUR);
+/**
+ * @brief turn some unused space into a tombstone partition.
+ * @details the space is punched out of the file when possible, its checksum
+ * is then the one of zeros, otherwise the data left there is checksummed.
+ *
+ * @param[in] off the tombstone header offset.
+ * @param[in] size the tombstone data size.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_write_del(bpk *bpk, off_t off, bpk_size size)
+{
+    bpk_part part;
+    bpk_cksum_ctx ctx;
+    uint32_t crc;
 
-    if (bpk_read_part(bpk, &part) == 0)
+    bpk_cksum_init(&ctx, BPK_CKSUM_CRC32);
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (size == 0 || (bpk->fd >= 0 && fallocate(bpk->fd,
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    off + sizeof (bpk_part), size) == 0))
     {
-        if (size != NULL)
-            *size = part.size;
-        if (crc != NULL)
-            *crc = part.crc;
-        if (hw_id != NULL)
-            *hw_id = part.hw_id;
-        bpk->ppos = 0;
-        bpk->psize = part.size;
-        return part.type;
+        bpk_cksum_zeros(&ctx, size);
+        crc = bpk_cksum_final(&ctx);
     }
-    return BPK_TYPE_INVALID;
+    else
+#endif
+        crc = bpk_data_cksum(bpk, NULL, off + sizeof (bpk_part), size,
+                BPK_CKSUM_CRC32, bpk_buffer(bpk), bpk->buff_size);
+
+    part.type = htobe32(BPK_TYPE_DEL);
+    part.hw_id = 0;
+    part.spare = htobe32(BPK_CKSUM_CRC32);
+    part.size = htobe64(size);
+    part.crc = htobe32(crc);
+    return bpk_pwrite(bpk, &part, sizeof (bpk_part), off);
 }
 
-void bpk_rewind(bpk *bpk)
+int bpk_remove(bpk *bpk, bpk_type type, uint32_t hw_id)
 {
-    fseek(bpk->fd, sizeof (bpk_header), SEEK_SET);
-    bpk->ppos = bpk->psize = 0;
+    bpk_index_entry entry;
+    uint32_t del = htobe32(BPK_TYPE_DEL);
+    int ret;
+
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -2;
+    }
+    else if (bpk_locate(bpk, type, hw_id, &entry) != 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* only the type changes, the data checksum stays valid */
+    ret = bpk_pwrite(bpk, &del, sizeof (del),
+            entry.offset - sizeof (bpk_part) + offsetof(bpk_part, type));
+    bpk_edited(bpk);
+    return (ret == 0) ? 0 : -3;
 }
 
-uint32_t bpk_compute_data_crc(bpk *bpk)
+typedef struct {
+    int fd;
+    bpk_size left;
+} bpk_fill_fd_arg;
+
+/**
+ * @brief bpk_fill_func reading a given length from a file.
+ */
+static ssize_t bpk_fill_fd(void *buf, size_t count, void *arg)
 {
-    bpk_size size;
+    bpk_fill_fd_arg *fill = arg;
     ssize_t len;
-    char *buff;
-    uint32_t crc = BPK_CRC_SEED;
 
-    buff = malloc(2048);
+    if (count > fill->left)
+        count = fill->left;
+    if (count == 0)
+        return 0;
+
+    do
+        len = read(fill->fd, buf, count);
+    while (len < 0 && errno == EINTR);
+
+    if (len == 0)
+        return -1; /* truncated since it was checked */
+    else if (len > 0)
+        fill->left -= len;
+    return len;
+}
+
+int bpk_replace(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        const char *file)
+{
+    bpk_index_entry entry;
+    bpk_fill_fd_arg fill;
+    struct stat st;
+    off_t hdr, end, size;
+    size_t align;
+    uint8_t flags;
+    uint32_t del = htobe32(BPK_TYPE_DEL);
+    int ret;
+
+    if (!(bpk->flags & FLAG_CRC))
+    {
+        errno = EBADF;
+        return -2;
+    }
+    else if (bpk_locate(bpk, type, hw_id, &entry) != 0)
+        return bpk_write(bpk, type, hw_id, file);
+
+    fill.fd = open(file, O_RDONLY);
+    if (fill.fd < 0)
+        return -1;
+
+    /* rewritten in place if it fits exactly, or with room for a tombstone */
+    if (fstat(fill.fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            ((bpk_size) st.st_size != entry.size &&
+             (bpk_size) st.st_size + sizeof (bpk_part) > entry.size))
+    {
+        close(fill.fd);
+
+        ret = bpk_write(bpk, type, hw_id, file);
+        if (ret == 0 && bpk_pwrite(bpk, &del, sizeof (del),
+                    entry.offset - sizeof (bpk_part) +
+                    offsetof(bpk_part, type)) != 0)
+            ret = -3;
+        bpk_edited(bpk);
+        return ret;
+    }
+
+    hdr = entry.offset - sizeof (bpk_part);
+    end = entry.offset + entry.size;
+    size = bpk->size;
+    align = bpk->align;
+    flags = bpk->flags;
+
+    /* the data size must be known in advance, neither padded nor sparse */
+    bpk_edited(bpk);
+    bpk->size = hdr;
+    bpk->align = 0;
+    bpk->flags &= ~FLAG_SPARSE;
+    fill.left = st.st_size;
+    ret = bpk_write_custom(bpk, type, hw_id, bpk_fill_fd, &fill);
+    close(fill.fd);
+
+    if (ret == -5)
+        ; /* nothing written */
+    else if (ret != 0)
+        bpk_write_del(bpk, hdr, entry.size); /* the old data is lost */
+    else if (bpk->size != end &&
+            bpk_write_del(bpk, bpk->size, end - bpk->size -
+                sizeof (bpk_part)) != 0)
+        ret = -3;
+
+    bpk->size = size;
+    bpk->align = align;
+    bpk->flags = flags;
+    bpk_edited(bpk);
+    return ret;
+}
+
+/**
+ * @brief move some data towards the beginning of the file.
+ * @details chunks are copied in-kernel when source and destination don't
+ * overlap, buffered copies are safe otherwise as data only moves down.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_move(bpk *bpk, off_t src, off_t dst, bpk_size len)
+{
+    unsigned char *buff = bpk_buffer(bpk);
+    int mode = BPK_COPY_FIRST(bpk);
+    off_t in_off, out_off;
+    size_t chunk;
+    bpk_size left;
+
     if (buff == NULL)
-        return 0xFFFFFFFF;
+        return -1;
+
+    /* in-kernel copies don't go through bpk_pwrite */
+    bpk->win_len = 0;
+    while (len != 0)
+    {
+        chunk = (len > BPK_COPY_CHUNK) ? BPK_COPY_CHUNK : len;
+        if (mode != BPK_COPY_BUFFERED && (bpk_size) (src - dst) >= chunk)
+        {
+            in_off = src;
+            out_off = dst;
+            left = chunk;
+            if (bpk_copy_fd(bpk->fd, &in_off, bpk->fd, &out_off, &left,
+                        &mode) != 0)
+                return -1;
+            chunk -= left;
+        }
+        else
+        {
+            chunk = (chunk > bpk->buff_size) ? bpk->buff_size : chunk;
+            if (bpk_pread(bpk, buff, chunk, src) != (ssize_t) chunk ||
+                    bpk_pwrite(bpk, buff, chunk, dst) != 0)
+                return -1;
+        }
+        src += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
 
-    if (bpk->ppos != 0)
-        fseek(bpk->fd, -bpk->ppos, SEEK_CUR);
+/**
+ * @brief find the alignment of a package from its padding partitions.
+ * @return the smallest alignment of the partitions following some padding,
+ * 0 if there's no padding.
+ */
+static size_t bpk_padding_align(bpk *bpk)
+{
+    bpk_index_entry entry;
+    off_t off = sizeof (bpk_header);
+    bpk_size low;
+    size_t align = 0;
+    int padded = 0;
 
-    for (size = bpk->psize; size != 0; )
+    while (bpk_read_part_at(bpk, off, &entry) == 0)
     {
-        len = (size > 2048) ? 2048 : size;
+        if (entry.type == BPK_TYPE_PAD)
+            padded = 1;
+        else if (padded && !bpk_type_hidden(entry.type))
+        {
+            /* lowest bit set of the data offset */
+            low = (bpk_size) entry.offset & -(bpk_size) entry.offset;
+            if (align == 0 || low < align)
+                align = low;
+            padded = 0;
+        }
+        off = entry.offset + entry.size;
+    }
+    return align;
+}
 
-        len = fread(buff, 1, len, bpk->fd);
-        if (len <= 0)
-            break;
+int bpk_compact(bpk *bpk)
+{
+    bpk_index_entry entry;
+    bpk_part part;
+    off_t src = sizeof (bpk_header), dst = src, next;
+    size_t align;
+    ssize_t pad;
+    int ret = 0;
 
-        size -= len;
-        crc = bpk_crc32(buff, len, crc);
+    if (!(bpk->flags & FLAG_CRC) || bpk->stream != NULL)
+    {
+        errno = EBADF;
+        return -2;
+    }
+
+    /* existing padding is dropped, keep the package alignment anyway */
+    align = (bpk->align != 0) ? bpk->align : bpk_padding_align(bpk);
+
+    while (ret == 0 && bpk_read_part_at(bpk, src, &entry) == 0)
+    {
+        next = entry.offset + entry.size;
+        if (bpk_type_hidden(entry.type))
+        {
+            /* tombstones and padding are dropped, the table of contents
+             * is rewritten when closing the file */
+            src = next;
+            continue;
+        }
+
+        /* padding is recomputed, as long as data doesn't move up */
+        pad = bpk_pad_size(align, dst);
+        if (pad >= 0 &&
+                dst + (off_t) (2 * sizeof (bpk_part)) + pad <= entry.offset)
+        {
+            bpk_pad_header(&part, pad);
+            if (bpk_zero_range(bpk, dst + sizeof (bpk_part), pad) != 0 ||
+                    bpk_pwrite(bpk, &part, sizeof (bpk_part),
+                        dst) != 0)
+                ret = -3;
+            dst += sizeof (bpk_part) + pad;
+        }
+
+        if (ret == 0 && dst != src &&
+                bpk_move(bpk, src, dst, next - src) != 0)
+            ret = -3;
+        dst += next - src;
+        src = next;
     }
-    free(buff);
 
-    fseek(bpk->fd, bpk->ppos - bpk->psize + size, SEEK_CUR);
-    return (size == 0) ? crc : 0xFFFFFFFF;
+    if (ret == 0)
+    {
+        bpk->size = dst;
+        if (bpk->ops->truncate(bpk->io, dst) != 0)
+            ret = -3;
+    }
+    bpk_edited(bpk);
+    return ret;
 }
 
-bpk_size bpk_read(bpk *bpk, void *buf, bpk_size size)
+bpk_cursor *bpk_cursor_new(bpk *bpk)
 {
-    if (size > (bpk_size) (bpk->psize - bpk->ppos))
-        size = bpk->psize - bpk->ppos;
+    bpk_cursor *cur;
 
-    if (size <= 0)
-        return 0;
+    if (bpk->flags & FLAG_CRC)
+    {
+        /* read-only handles only, writes would change the index */
+        errno = EBADF;
+        return NULL;
+    }
+    else if (bpk_build_index(bpk) != 0)
+        return NULL;
 
-    size = fread(buf, 1, size, bpk->fd);
-    if (ferror(bpk->fd) != 0)
-        errno = EIO;
+    cur = malloc(sizeof (bpk_cursor));
+    if (cur == NULL)
+        return NULL;
 
-    bpk->ppos += size;
-    return size;
+    cur->parent = bpk;
+    cur->buff = NULL;
+    cur->buff_size = 0;
+    cur->psparse = NULL;
+    bpk_cursor_rewind(cur);
+    return cur;
 }
 
-int bpk_read_file(bpk *bpk, const char *file)
+void bpk_cursor_free(bpk_cursor *cur)
 {
-    FILE *fd_out;
-    char *buff;
-    size_t len;
-    bpk_size size = bpk->psize - bpk->ppos;
+    if (cur == NULL)
+        return;
+    bpk_sparse_free(cur->psparse);
+    free(cur->buff);
+    free(cur);
+}
+
+/**
+ * @brief make a partition the current one for a cursor.
+ */
+static bpk_type bpk_cursor_select(
+        bpk_cursor *cur,
+        size_t index,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id)
+{
+    const bpk_index_entry *entry;
+    bpk_sparse *sp = NULL;
+
+    entry = (index < cur->parent->index->count) ?
+        &cur->parent->index->parts[index] : NULL;
+    if (entry == NULL || (entry->sparse &&
+                (sp = bpk_sparse_load(cur->parent, entry->offset,
+                                      entry->size)) == NULL))
+    {
+        cur->ppos = cur->psize = 0;
+        return BPK_TYPE_INVALID;
+    }
+    bpk_sparse_free(cur->psparse);
+    cur->psparse = sp;
+
+    cur->pidx = index + 1;
+    cur->poff = entry->offset;
+    cur->ppos = 0;
+    cur->psize = (sp != NULL) ? sp->size : entry->size;
+    cur->pcksum = entry->cksum;
+    if (size != NULL)
+        *size = cur->psize;
+    if (crc != NULL)
+        *crc = entry->crc;
+    if (hw_id != NULL)
+        *hw_id = entry->hw_id;
+    return entry->type;
+}
+
+int bpk_cursor_find(
+        bpk_cursor *cur,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size *size,
+        uint32_t *crc)
+{
+    ssize_t pos = bpk_index_find(cur->parent->index, type, hw_id);
 
-    fd_out = fopen(file, "w");
-    if (fd_out == NULL)
+    if (pos < 0 ||
+            bpk_cursor_select(cur, pos, size, crc, NULL) == BPK_TYPE_INVALID)
+    {
+        bpk_cursor_rewind(cur);
         return -1;
+    }
+    return 0;
+}
 
-    buff = malloc(2048);
-    if (buff == NULL)
+bpk_type bpk_cursor_next(
+        bpk_cursor *cur,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id)
+{
+    return bpk_cursor_select(cur, cur->pidx, size, crc, hw_id);
+}
+
+void bpk_cursor_rewind(bpk_cursor *cur)
+{
+    cur->pidx = 0;
+    cur->poff = cur->ppos = cur->psize = 0;
+    cur->pcksum = BPK_CKSUM_CRC32;
+    bpk_sparse_free(cur->psparse);
+    cur->psparse = NULL;
+}
+
+int bpk_cursor_seek(bpk_cursor *cur, bpk_size pos)
+{
+    if (pos > (bpk_size) cur->psize)
     {
-        fclose(fd_out);
-        return -2;
+        errno = EINVAL;
+        return -1;
     }
+    cur->ppos = pos;
+    return 0;
+}
 
-    while (size != 0)
+bpk_size bpk_cursor_read(bpk_cursor *cur, void *buf, bpk_size size)
+{
+    return bpk_data_read(cur->parent, cur->psparse, cur->poff, cur->psize,
+            &cur->ppos, buf, size);
+}
+
+uint32_t bpk_cursor_compute_data_crc(bpk_cursor *cur)
+{
+    if (cur->buff == NULL)
     {
-        len = (size > 2048) ? 2048 : size;
+        cur->buff_size = cur->parent->buff_size;
+        cur->buff = malloc(cur->buff_size);
+    }
 
-        len = fread(buff, 1, len, bpk->fd);
-        if (len <= 0)
-            break;
+    return bpk_data_cksum(cur->parent, cur->psparse, cur->poff, cur->psize,
+            cur->pcksum, cur->buff, cur->buff_size);
+}
 
-        size -= len;
-        bpk->ppos += len;
+/**
+ * @brief read some data from a reader input.
+ * @param[out] buf the buffer to fill, NULL to skip the data.
+ * @param[in] len the exact number of bytes to read.
+ * @return
+ *  - 0 on success.
+ *  - -1 on read error or end of input (EIO).
+ */
+static int bpk_reader_get(bpk_reader *rd, void *buf, bpk_size len)
+{
+    size_t n;
+    ssize_t rlen;
+
+    while (len != 0)
+    {
+        if (rd->buff_pos == rd->buff_len)
+        {
+            rlen = rd->func(rd->buff, rd->buff_size, rd->func_arg);
+            if (rlen <= 0)
+            {
+                errno = EIO;
+                return -1;
+            }
+            rd->buff_pos = 0;
+            rd->buff_len = rlen;
+        }
 
-        if (fwrite(buff, len, 1, fd_out) != 1)
+        n = rd->buff_len - rd->buff_pos;
+        if (len < n)
+            n = len;
+        if (buf != NULL)
         {
-            fclose(fd_out);
-            free(buff);
-            errno = EIO;
-            return -3;
+            memcpy(buf, rd->buff + rd->buff_pos, n);
+            buf = (unsigned char *) buf + n;
         }
+        rd->buff_pos += n;
+        rd->pos += n;
+        len -= n;
     }
-    free(buff);
-    if (ferror(fd_out) != 0)
+    return 0;
+}
+
+/**
+ * @brief allocate a reader and read the package header.
+ * @param[in] arg func argument, NULL to give it the address of fd.
+ */
+static bpk_reader *bpk_reader_open(bpk_fill_func func, void *arg, int fd)
+{
+    bpk_reader *rd;
+    bpk_header hdr;
+
+    rd = malloc(sizeof (bpk_reader));
+    if (rd == NULL)
+        return NULL;
+
+    rd->func = func;
+    rd->fd = fd;
+    rd->func_arg = (arg != NULL) ? arg : &rd->fd;
+    rd->buff_size = BPK_BUFF_SIZE;
+    rd->buff_pos = rd->buff_len = 0;
+    rd->pos = 0;
+    rd->status = 0;
+    rd->left = 0;
+    rd->psparse = 0;
+    /* no current partition: reads as an empty valid one */
+    rd->pcheck = (bpk_cksum_init(&rd->ctx, BPK_CKSUM_CRC32) == 0);
+    rd->pcrc = bpk_cksum_final(&rd->ctx);
+    rd->buff = malloc(rd->buff_size);
+    if (rd->buff == NULL)
     {
-        fclose(fd_out);
-        errno = EIO;
-        return -4;
+        free(rd);
+        return NULL;
     }
-    fclose(fd_out);
-    bpk->ppos = bpk->psize = 0;
+
+    if (bpk_reader_get(rd, &hdr, sizeof (bpk_header)) != 0)
+    {
+        bpk_reader_free(rd);
+        return NULL;
+    }
+
+    rd->size = be64toh(hdr.size);
+    rd->crc = be32toh(hdr.crc);
+    if (be32toh(hdr.magic) != BPK_MAGIC ||
+            BPK_MAJOR(be32toh(hdr.version)) > BPK_MAJOR(BPK_VERSION) ||
+            rd->size < sizeof (bpk_header))
+    {
+        bpk_reader_free(rd);
+        errno = EILSEQ;
+        return NULL;
+    }
+    hdr.crc = 0;
+    rd->hcrc = bpk_crc32(&hdr, sizeof (bpk_header), BPK_CRC_SEED);
+    return rd;
+}
+
+bpk_reader *bpk_reader_new(int fd)
+{
+    return bpk_reader_open(bpk_fill_read, NULL, fd);
+}
+
+bpk_reader *bpk_reader_new_custom(bpk_fill_func func, void *arg)
+{
+    return bpk_reader_open(func, arg, -1);
+}
+
+void bpk_reader_free(bpk_reader *rd)
+{
+    if (rd == NULL)
+        return;
+    free(rd->buff);
+    free(rd);
+}
+
+int bpk_reader_next(
+        bpk_reader *rd,
+        bpk_type *type,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id)
+{
+    bpk_part part;
+    bpk_type ptype = BPK_TYPE_INVALID;
+
+    do
+    {
+        if (rd->status != 0)
+            break;
+
+        /* skip the end of the current partition */
+        if (bpk_reader_get(rd, NULL, rd->left) != 0)
+            rd->status = -3;
+        else if (rd->pos == rd->size)
+        {
+            rd->status = (rd->hcrc == rd->crc) ? 1 : -1;
+            if (rd->status != 1)
+                errno = EBADMSG;
+        }
+        else if (rd->size - rd->pos < sizeof (bpk_part))
+        {
+            rd->status = -2;
+            errno = EILSEQ;
+        }
+        else if (bpk_reader_get(rd, &part, sizeof (bpk_part)) != 0)
+            rd->status = -3;
+        else
+        {
+            rd->hcrc = bpk_crc32(&part, sizeof (bpk_part), rd->hcrc);
+            ptype = be32toh(part.type);
+            rd->left = be64toh(part.size);
+            if (rd->left > rd->size - rd->pos)
+            {
+                rd->status = -2;
+                errno = EILSEQ;
+            }
+        }
+        rd->left = (rd->status == 0) ? rd->left : 0;
+    }
+    while (rd->status == 0 && bpk_type_hidden(ptype));
+
+    if (rd->status != 0)
+        return rd->status;
+
+    rd->pcrc = be32toh(part.crc);
+    rd->psparse = (be32toh(part.spare) & BPK_PART_SPARSE) != 0;
+    rd->pcheck = bpk_cksum_init(&rd->ctx,
+            be32toh(part.spare) & ~BPK_PART_SPARSE) == 0;
+    if (type != NULL)
+        *type = ptype;
+    if (size != NULL)
+        *size = rd->left;
+    if (crc != NULL)
+        *crc = rd->pcrc;
+    if (hw_id != NULL)
+        *hw_id = be32toh(part.hw_id);
     return 0;
 }
 
+ssize_t bpk_reader_read(bpk_reader *rd, void *buf, size_t size)
+{
+    ssize_t len;
+
+    if (rd->psparse)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    else if (rd->left == 0)
+    {
+        /* data was entirely read, or there's no current partition */
+        if (rd->status != 0)
+            return 0;
+        errno = !rd->pcheck ? EOPNOTSUPP :
+            (bpk_cksum_final(&rd->ctx) != rd->pcrc) ? EBADMSG : 0;
+        return (errno == 0) ? 0 : -1;
+    }
+
+    if (size > rd->left)
+        size = rd->left;
+    if (size > SSIZE_MAX)
+        size = SSIZE_MAX;
+
+    if (rd->buff_pos != rd->buff_len || size < rd->buff_size)
+    {
+        len = rd->buff_len - rd->buff_pos;
+        if (len == 0 || (size_t) len > size)
+            len = size;
+        if (bpk_reader_get(rd, buf, len) != 0)
+            return -1;
+    }
+    else
+    {
+        /* large reads go straight to the caller's buffer */
+        len = rd->func(buf, size, rd->func_arg);
+        if (len <= 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        rd->pos += len;
+    }
+
+    rd->left -= len;
+    if (rd->pcheck)
+        bpk_cksum_update(&rd->ctx, buf, len);
+    return len;
+}
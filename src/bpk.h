@@ -44,12 +44,87 @@ BEGIN_DECLS
 #define BPK_TYPE_RFS 0x50524653 /* PRFS */
 #define BPK_TYPE_FWV 0x46575600 /* FWV */
 #define BPK_TYPE_DEZC 0x44455A43 /* DEZC */
+#define BPK_TYPE_TOC 0x42544F43 /* BTOC: table of contents, skipped by readers */
+#define BPK_TYPE_PAD 0x42504144 /* BPAD: alignment padding, skipped by readers */
+#define BPK_TYPE_DEL 0x4244454C /* BDEL: removed partition, skipped by readers */
 #define BPK_TYPE_INVALID 0xDEADBEEF
 
+#define BPK_OPEN_APPEND 0x01 /* open in RW mode to append parts */
+#define BPK_OPEN_MMAP 0x02 /* map the file read-only */
+#define BPK_OPEN_INDEX 0x04 /* index partitions when opening */
+
+#define BPK_READ_NOCHECK 0x01 /* don't verify the partition checksum */
+
+#define BPK_CKSUM_CRC32 0 /* crc32, legacy */
+#define BPK_CKSUM_CRC32C 1 /* crc32c (Castagnoli), hardware accelerated */
+#define BPK_CKSUM_XXH3 2 /* XXH3 64 bits, truncated to its lower 32 bits */
+
 typedef struct bpk bpk;
+typedef struct bpk_cursor bpk_cursor;
+typedef struct bpk_reader bpk_reader;
+typedef struct bpk_mem bpk_mem;
 
 typedef uint32_t bpk_type;
 typedef uint64_t bpk_size;
+typedef uint32_t bpk_cksum;
+
+#define BPK_VERIFY_OK 0 /* partition data is valid */
+#define BPK_VERIFY_CRC -1 /* partition data crc mismatch */
+#define BPK_VERIFY_TRUNCATED -2 /* partition data is truncated */
+#define BPK_VERIFY_CKSUM -3 /* unsupported checksum algorithm */
+
+/**
+ * @brief bpk_verify_all partition result.
+ */
+typedef struct {
+    bpk_type type; /**!< partition type */
+    uint32_t hw_id; /**!< partition hardware id */
+    bpk_size size; /**!< partition size */
+    bpk_cksum cksum; /**!< partition checksum algorithm */
+    uint32_t crc; /**!< crc stored in the partition header */
+    uint32_t computed; /**!< computed crc */
+    int status; /**!< BPK_VERIFY_* status */
+} bpk_verify_result;
+
+/**
+ * @brief bpk package storage backend (see bpk_open_ops).
+ * @details every function gets the io argument given to bpk_open_ops,
+ * offsets are from the beginning of the package. read_at may be called
+ * concurrently by cursors.
+ */
+typedef struct {
+    /**
+     * @brief read some data, returning the length read (short at the end
+     * of the package) or -1 on error.
+     */
+    ssize_t (*read_at)(void *io, void *buf, size_t len, bpk_size off);
+    /**
+     * @brief write a whole buffer, growing the package if needed,
+     * returning 0 on success or -1 on error.
+     */
+    int (*write_at)(void *io, const void *buf, size_t len, bpk_size off);
+    /** @brief get the package size, returning 0 on success. */
+    int (*size)(void *io, bpk_size *size);
+    /**
+     * @brief change the package size, zero filling when growing,
+     * returning 0 on success.
+     */
+    int (*truncate)(void *io, bpk_size size);
+    /** @brief flush written data to storage, may be NULL. */
+    int (*sync)(void *io);
+} bpk_io_ops;
+
+/**
+ * @brief file descriptor backend, io points to the file descriptor.
+ * @details it isn't closed with the package, file specific optimizations
+ * (mapping, in-kernel copies, holes) are kept.
+ */
+EXPORT extern const bpk_io_ops bpk_io_fd;
+
+/**
+ * @brief memory backend, io is a bpk_mem buffer (see bpk_mem_new).
+ */
+EXPORT extern const bpk_io_ops bpk_io_mem;
 
 /**
  * @brief create a new bpk package.
@@ -60,6 +135,35 @@ typedef uint64_t bpk_size;
  */
 EXPORT bpk *bpk_create(const char *file);
 
+/**
+ * @brief create a new bpk package on a non-seekable output (pipe, socket).
+ * @details parts are queued by bpk_write and bpk_write_custom, and the
+ * package written in a single pass by bpk_stream_end (or bpk_close).
+ * Regular files are read when the package is written, a first time for
+ * their checksum, and must not change until then. Other inputs are
+ * buffered in memory, up to 64MiB for the whole package.
+ * Sparse partitions aren't supported.
+ *
+ * @param[in] fd the output, it's duplicated so the caller keeps it open.
+ * @return
+ *  - the newly created bpk file.
+ *  - NULL on error (setting errno).
+ */
+EXPORT bpk *bpk_create_stream(int fd);
+
+/**
+ * @brief write a streamed package (see bpk_create_stream).
+ * @details the bpk file can only be closed afterwards, writing more parts
+ * fails with EBADF.
+ * @param[in] bpk the bpk file to write.
+ * @return
+ *  - 0 on success.
+ *  - -2 if the file isn't a streamed package, or was already written.
+ *  - -3 on I/O error (setting errno).
+ *  - -5 on allocation failure.
+ */
+EXPORT int bpk_stream_end(bpk *bpk);
+
 /**
  * @brief open an existing bpk package.
  * @details when append is true the file is opened in RW mode, appending some
@@ -73,12 +177,91 @@ EXPORT bpk *bpk_create(const char *file);
  */
 EXPORT bpk *bpk_open(const char *file, int append);
 
+/**
+ * @brief open an existing bpk package with some options.
+ * @details with BPK_OPEN_MMAP the file is mapped read-only, the read
+ * functions then work directly on the mapping, without copies nor syscalls,
+ * this can't be combined with BPK_OPEN_APPEND.
+ *
+ * @param[in] file the file to open.
+ * @param[in] flags a combination of BPK_OPEN_* flags.
+ * @return
+ *  - the opened bpk file.
+ *  - NULL on error (setting errno).
+ */
+EXPORT bpk *bpk_open_flags(const char *file, int flags);
+
+/**
+ * @brief open a bpk package on a storage backend.
+ * @details with BPK_OPEN_APPEND an empty backend is initialized with a new
+ * package. BPK_OPEN_MMAP only applies to bpk_io_fd.
+ * The backend sync function is called when the bpk file is closed, the
+ * backend itself is left open.
+ *
+ * @param[in] ops the backend functions.
+ * @param[in] io the backend argument, given to ops functions.
+ * @param[in] flags a combination of BPK_OPEN_* flags.
+ * @return
+ *  - the opened bpk file.
+ *  - NULL on error (setting errno).
+ */
+EXPORT bpk *bpk_open_ops(const bpk_io_ops *ops, void *io, int flags);
+
+/**
+ * @brief create a growable memory buffer, for bpk_io_mem.
+ * @param[in] data initial content, copied, may be NULL.
+ * @param[in] size size of data.
+ * @return
+ *  - the new buffer.
+ *  - NULL on allocation failure.
+ */
+EXPORT bpk_mem *bpk_mem_new(const void *data, size_t size);
+
+/**
+ * @brief release a memory buffer.
+ * @param[in] mem the buffer to release.
+ */
+EXPORT void bpk_mem_free(bpk_mem *mem);
+
+/**
+ * @brief access the content of a memory buffer.
+ * @details the pointer is valid until the buffer is written again.
+ * @param[in] mem the buffer.
+ * @param[out] size the size of the content.
+ * @return the content, NULL if empty.
+ */
+EXPORT const void *bpk_mem_data(const bpk_mem *mem, size_t *size);
+
 /**
  * @brief close a bpk file.
  * @param[in] bpk the file to close.
  */
 EXPORT void bpk_close(bpk *bpk);
 
+/**
+ * @brief set the size of the I/O buffer used to read and write partitions.
+ * @details defaults to 128KiB, the buffer size is also the maximum size
+ * requested to a bpk_fill_func.
+ *
+ * @param[in] bpk the bpk file.
+ * @param[in] size the buffer size.
+ * @return
+ *  - 0 on success.
+ *  - < 0 if the size is too small (setting errno).
+ */
+EXPORT int bpk_set_buffer_size(bpk *bpk, size_t size);
+
+/**
+ * @brief get the size of the I/O buffer.
+ * @details this is the preferred size of the chunks given to the library:
+ * producers using bpk_write_lend should lend at least this much data per
+ * call.
+ *
+ * @param[in] bpk the bpk file.
+ * @return the buffer size.
+ */
+EXPORT size_t bpk_get_buffer_size(bpk *bpk);
+
 /**
  * @brief check a bpk file crc.
  * @details this crc only covers the headers.
@@ -90,6 +273,28 @@ EXPORT void bpk_close(bpk *bpk);
  */
 EXPORT int bpk_check_crc(bpk *bpk);
 
+/**
+ * @brief check a bpk file header crc and all its partitions data crc.
+ * @details the file is read once, in a single forward sequential scan using
+ * large reads, the read pointer is moved back to the first partition.
+ * Internal partitions (table of contents, padding, removed partitions) are
+ * verified as well but, as for bpk_count, they are not listed in results.
+ *
+ * @param[in] bpk the bpk file.
+ * @param[out] results an array of per-partition results, in file order, to
+ * be released using free() (may be NULL).
+ * @param[out] count the number of elements in results (may be NULL).
+ * @return
+ *  - 0 if the header and all the partitions are valid.
+ *  - -1 if the header crc is invalid.
+ *  - -2 if the header is valid but some partition is not.
+ *  - -3 on error (setting errno), results are then not allocated.
+ */
+EXPORT int bpk_verify_all(
+        bpk *bpk,
+        bpk_verify_result **results,
+        size_t *count);
+
 /**
  * @brief compute the file's crc.
  *
@@ -101,6 +306,93 @@ EXPORT int bpk_check_crc(bpk *bpk);
  */
 EXPORT uint32_t bpk_compute_crc(bpk *bpk, uint32_t *file_crc);
 
+/**
+ * @brief set the checksum algorithm of the parts written afterwards.
+ * @details the algorithm is recorded in each part header, parts using
+ * another algorithm than BPK_CKSUM_CRC32 require a 1.1 reader.
+ *
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] algo the checksum algorithm (BPK_CKSUM_*).
+ * @return
+ *  - 0 on success.
+ *  - < 0 if the algorithm is not supported (setting errno).
+ */
+EXPORT int bpk_set_cksum(bpk *bpk, bpk_cksum algo);
+
+/**
+ * @brief get current partition checksum algorithm.
+ * @param[in] bpk the bpk file.
+ * @return the algorithm used to compute the partition crc (BPK_CKSUM_*).
+ */
+EXPORT bpk_cksum bpk_get_cksum(bpk *bpk);
+
+/**
+ * @brief write a table of contents when closing the file.
+ * @details the table of contents is stored in a BPK_TYPE_TOC partition at
+ * the end of the file, it lets readers load the partition index with a
+ * single read. Older readers see it as an unknown partition.
+ * A table of contents found when opening in append mode is kept up to date.
+ *
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] enable non-zero to write a table of contents.
+ * @return
+ *  - 0 on success.
+ *  - < 0 on error (setting errno).
+ */
+EXPORT int bpk_set_toc(bpk *bpk, int enable);
+
+/**
+ * @brief align the data of the parts written afterwards.
+ * @details BPK_TYPE_PAD partitions are inserted as needed so that partition
+ * data starts on an align boundary (ex: the page size for O_DIRECT and
+ * reflinks, or a NAND erase block), readers skip these partitions.
+ * Padding is left as holes in the file when possible.
+ *
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] align the alignment, a power of two, 0 to disable.
+ * @return
+ *  - 0 on success.
+ *  - < 0 on error (setting errno).
+ */
+EXPORT int bpk_set_align(bpk *bpk, size_t align);
+
+/**
+ * @brief store the parts written afterwards as sparse partitions.
+ * @details holes are found with SEEK_DATA/SEEK_HOLE on regular files, and
+ * by looking for zero blocks in streamed data. Only the data extents and an
+ * extent table are stored, the partition size and checksum still cover the
+ * whole content, holes being read as zeros. Extraction recreates the holes.
+ * Packages holding sparse partitions are written as version 2.0, which 1.x
+ * readers refuse to open, as they would return the stored extents instead
+ * of the partition data.
+ *
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] enable non-zero to store sparse partitions.
+ * @return
+ *  - 0 on success.
+ *  - < 0 on error (setting errno).
+ */
+EXPORT int bpk_set_sparse(bpk *bpk, int enable);
+
+/**
+ * @brief reserve the space of the parts to come.
+ * @details the space is allocated with fallocate, without changing the file
+ * size, so that large packages aren't fragmented when all the inputs sizes
+ * are known. Space left unused is released when closing the file.
+ * Parts whose size is known (regular files, bpk_write_sized) are
+ * preallocated anyway.
+ * Room for the partition headers, and for the padding when an alignment is
+ * set (see bpk_set_align), is added to the reserved space.
+ *
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] size the total data size of the parts to come.
+ * @param[in] count the number of parts to come.
+ * @return
+ *  - 0 on success.
+ *  - < 0 on error (setting errno), EOPNOTSUPP if not supported.
+ */
+EXPORT int bpk_set_prealloc(bpk *bpk, bpk_size size, size_t count);
+
 /**
  * @brief write a file in the bpk package.
  * @param[in] bpk the bpk file to edit.
@@ -144,6 +436,111 @@ EXPORT int bpk_write_custom(
         bpk_fill_func func,
         void *func_arg);
 
+/**
+ * @brief write a part of a known size using a custom reading func.
+ * @details the part space is preallocated and its size written in the
+ * header right away.
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] type the part type.
+ * @param[in] hw_id the associated hardware id.
+ * @param[in] size the part size.
+ * @param[in] func file reading function.
+ * @param[in] func_arg file reading function argument.
+ * @return
+ *  - 0 on success.
+ *  - -4 if func fails or doesn't provide exactly size bytes (EIO).
+ *  - < 0 on failure (setting errno).
+ */
+EXPORT int bpk_write_sized(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size size,
+        bpk_fill_func func,
+        void *func_arg);
+
+/**
+ * @brief bpk reading function lending its own buffers.
+ * @param[out] buf set to the data, which must stay valid until the next
+ * call.
+ * @param[in] attr user argument.
+ * @return
+ *  - the size of the data.
+ *  - 0 on EOF.
+ *  - <0 on error.
+ */
+typedef ssize_t (*bpk_lend_func)(const void **buf, void *attr);
+
+/**
+ * @brief write a part using a custom reading func lending its buffers.
+ * @details the checksum is computed and the data written straight from the
+ * lent buffers, without going through the I/O buffer (see
+ * bpk_get_buffer_size for the preferred chunk size).
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] type the part type.
+ * @param[in] hw_id the associated hardware id.
+ * @param[in] func file reading function.
+ * @param[in] func_arg file reading function argument.
+ * @return
+ *  - 0 on success.
+ *  - -4 if func fails (EIO).
+ *  - < 0 on failure (setting errno).
+ */
+EXPORT int bpk_write_lend(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_lend_func func,
+        void *func_arg);
+
+/**
+ * @brief replace a partition by a file.
+ * @details the partition is rewritten in place if the file has the same size
+ * or leaves room for a tombstone partition, otherwise the file is appended
+ * and the old partition turned into a tombstone, see bpk_compact.
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] type the part type.
+ * @param[in] hw_id the associated hardware id.
+ * @param[in] file the file to write, appended if the partition is missing.
+ * @return
+ *  - 0 on success.
+ *  - -2 if the file isn't writable.
+ *  - < 0 on failure (setting errno).
+ */
+EXPORT int bpk_replace(
+        bpk *bpk,
+        bpk_type type,
+        uint32_t hw_id,
+        const char *file);
+
+/**
+ * @brief remove a partition.
+ * @details the partition is turned into a tombstone partition, skipped by
+ * readers, its space being reclaimed by bpk_compact.
+ * @param[in] bpk the bpk file to edit.
+ * @param[in] type the part type.
+ * @param[in] hw_id the associated hardware id.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the partition doesn't exist.
+ *  - -2 if the file isn't writable.
+ *  - -3 on I/O error (setting errno).
+ */
+EXPORT int bpk_remove(bpk *bpk, bpk_type type, uint32_t hw_id);
+
+/**
+ * @brief reclaim the space of removed partitions.
+ * @details partitions are slid towards the beginning of the file, padding is
+ * recomputed for the alignment set with bpk_set_align, or else for the
+ * alignment found from the existing padding, and the file is truncated.
+ * @param[in] bpk the bpk file to edit.
+ * @return
+ *  - 0 on success.
+ *  - -2 if the file isn't writable.
+ *  - -3 on I/O error (setting errno), the file must then be checked.
+ */
+EXPORT int bpk_compact(bpk *bpk);
+
 /**
  * @brief find a bpk partition.
  * @details the read pointer is moved to the found data section.
@@ -180,8 +577,44 @@ EXPORT bpk_type bpk_next(
         uint32_t *crc,
         uint32_t *hw_id);
 
+/**
+ * @brief get the number of partitions.
+ * @details builds the partition index if the file wasn't opened with
+ * BPK_OPEN_INDEX.
+ *
+ * @param[in] bpk the bpk file.
+ * @return
+ *  - the number of partitions.
+ *  - < 0 on error (setting errno).
+ */
+EXPORT ssize_t bpk_count(bpk *bpk);
+
+/**
+ * @brief select a partition by its position in the file.
+ * @details the read pointer is moved to the partition data section, a
+ * subsequent bpk_next() returns the following partition.
+ *
+ * @param[in] bpk the bpk file to seek.
+ * @param[in] index the partition position, starting at 0.
+ * @param[out] size the partition size.
+ * @param[out] crc the partition crc.
+ * @param[out] hw_id the partition hardware id.
+ * @return
+ *  - the partition type.
+ *  - BPK_TYPE_INVALID if index is out of range.
+ */
+EXPORT bpk_type bpk_part_at(
+        bpk *bpk,
+        size_t index,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id);
+
 /**
  * @brief compute current partition data crc.
+ * @details the partition's checksum algorithm is used (see bpk_get_cksum).
+ * The crc32 implementation can be forced with the BPK_CRC32 environment
+ * variable ("bytewise", "slice8" or "pclmul").
  * @param[in] bpk the bpk file.
  * @return
  *  - the computed crc.
@@ -189,6 +622,36 @@ EXPORT bpk_type bpk_next(
  */
 EXPORT uint32_t bpk_compute_data_crc(bpk *bpk);
 
+/**
+ * @brief compute current partition data crc using several threads.
+ * @details the partition is split in ranges, each range crc being computed
+ * by a worker thread using positional reads, the results are then combined.
+ * The read pointer is not moved, partitions using a checksum that can't be
+ * combined (BPK_CKSUM_XXH3) are computed on the calling thread.
+ *
+ * @param[in] bpk the bpk file.
+ * @param[in] threads number of threads to use (0 to use one per cpu).
+ * @return
+ *  - the computed crc.
+ *  - 0xFFFFFFFF on error.
+ */
+EXPORT uint32_t bpk_compute_data_crc_mt(bpk *bpk, unsigned int threads);
+
+/**
+ * @brief combine two crc32.
+ * @details returns the crc of the concatenation of two buffers A and B, given
+ * the crc of A, the crc of B and the length of B.
+ *
+ * @param[in] crc_a the first buffer crc.
+ * @param[in] crc_b the second buffer crc.
+ * @param[in] len_b the second buffer length.
+ * @return the combined crc.
+ */
+EXPORT uint32_t bpk_crc32_combine(
+        uint32_t crc_a,
+        uint32_t crc_b,
+        bpk_size len_b);
+
 /**
  * @brief move back to the first partition.
  * @param[in] bpk the bpk file to seek.
@@ -216,6 +679,193 @@ EXPORT bpk_size bpk_read(bpk *bpk, void *buf, bpk_size size);
  */
 EXPORT int bpk_read_file(bpk *bpk, const char *file);
 
+/**
+ * @brief saves current bpk partition in a file, bypassing the page cache.
+ * @details both the bpk file and the destination are accessed with
+ * O_DIRECT when the filesystems allow it, reading the next block while the
+ * previous one is written. The partition checksum is verified in the same
+ * pass when it is extracted from its beginning. Sparse partitions are
+ * verified, then extracted with bpk_read_file().
+ * @param[in] bpk the bpk to read.
+ * @param[in] file the file where to store the data.
+ * @param[in] block the I/O block size, a multiple of 4096, 0 for default.
+ * @return
+ *  - 0 on success.
+ *  - -5 if the data doesn't match the partition checksum (EBADMSG).
+ *  - < 0 on error (setting errno).
+ */
+EXPORT int bpk_read_file_direct(bpk *bpk, const char *file, size_t block);
+
+/**
+ * @brief custom data consumer, for bpk_read_custom.
+ * @param[in] buf the data, only valid during the call.
+ * @param[in] count the size of the data.
+ * @param[in] attr user argument.
+ * @return
+ *  - >= 0 on success.
+ *  - <0 on error, stopping the read.
+ */
+typedef int (*bpk_drain_func)(const void *buf, size_t count, void *attr);
+
+/**
+ * @brief read the current bpk partition using a custom writing func.
+ * @details func is given slices of the mapping on mapped files, and of the
+ * I/O buffer otherwise (see bpk_set_buffer_size), without any copy. The
+ * partition checksum is verified in the same pass when it is read from its
+ * beginning, unless BPK_READ_NOCHECK is set.
+ * @param[in] bpk the bpk to read.
+ * @param[in] func data writing function.
+ * @param[in] func_arg data writing function argument.
+ * @param[in] flags a combination of BPK_READ_* flags.
+ * @return
+ *  - 0 on success.
+ *  - -2 on allocation failure (ENOMEM) or unsupported checksum (EINVAL).
+ *  - -3 on read error (EIO).
+ *  - -4 if func fails (errno left as set by func).
+ *  - -5 if the data doesn't match the partition checksum (EBADMSG).
+ */
+EXPORT int bpk_read_custom(
+        bpk *bpk,
+        bpk_drain_func func,
+        void *func_arg,
+        int flags);
+
+/**
+ * @brief create a read cursor on a bpk file.
+ * @details a cursor has its own current partition and read position, and
+ * only uses positional reads: several threads can each use their own cursor
+ * on the same bpk file without locking.
+ * The bpk file must be opened read-only, the partition index is built if
+ * needed, so the first cursor should be created before sharing the bpk file
+ * between threads (or the file opened with BPK_OPEN_INDEX).
+ *
+ * @param[in] bpk the bpk file.
+ * @return
+ *  - the new cursor, before the first partition.
+ *  - NULL on error (setting errno).
+ */
+EXPORT bpk_cursor *bpk_cursor_new(bpk *bpk);
+
+/**
+ * @brief release a cursor.
+ * @param[in] cur the cursor to release.
+ */
+EXPORT void bpk_cursor_free(bpk_cursor *cur);
+
+/**
+ * @brief bpk_find() for cursors.
+ */
+EXPORT int bpk_cursor_find(
+        bpk_cursor *cur,
+        bpk_type type,
+        uint32_t hw_id,
+        bpk_size *size,
+        uint32_t *crc);
+
+/**
+ * @brief bpk_next() for cursors.
+ */
+EXPORT bpk_type bpk_cursor_next(
+        bpk_cursor *cur,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id);
+
+/**
+ * @brief bpk_rewind() for cursors.
+ */
+EXPORT void bpk_cursor_rewind(bpk_cursor *cur);
+
+/**
+ * @brief move in the current partition of a cursor.
+ * @param[in] cur the cursor.
+ * @param[in] pos the new position, from the beginning of the partition.
+ * @return
+ *  - 0 on success.
+ *  - < 0 if pos is past the end of the partition (setting errno).
+ */
+EXPORT int bpk_cursor_seek(bpk_cursor *cur, bpk_size pos);
+
+/**
+ * @brief bpk_read() for cursors.
+ */
+EXPORT bpk_size bpk_cursor_read(bpk_cursor *cur, void *buf, bpk_size size);
+
+/**
+ * @brief bpk_compute_data_crc() for cursors.
+ */
+EXPORT uint32_t bpk_cursor_compute_data_crc(bpk_cursor *cur);
+
+/**
+ * @brief create a forward-only reader on a package stream.
+ * @details the package is read in a single pass, using a fixed amount of
+ * memory, so that it can be installed as it's received (pipe, socket...).
+ * The package header is read and checked before returning.
+ *
+ * @param[in] fd the file to read, it's not closed by bpk_reader_free().
+ * @return
+ *  - the new reader, before the first partition.
+ *  - NULL on error (setting errno, EILSEQ if the stream is not a package).
+ */
+EXPORT bpk_reader *bpk_reader_new(int fd);
+
+/**
+ * @brief bpk_reader_new() reading the package from a custom function.
+ * @param[in] func the function providing the package, returning 0 at its
+ * end and < 0 on error.
+ * @param[in] arg user argument, given to func.
+ */
+EXPORT bpk_reader *bpk_reader_new_custom(bpk_fill_func func, void *arg);
+
+/**
+ * @brief release a reader.
+ * @param[in] rd the reader to release.
+ */
+EXPORT void bpk_reader_free(bpk_reader *rd);
+
+/**
+ * @brief move a reader to the next partition.
+ * @details the unread data of the current partition is skipped (and its
+ * checksum isn't verified), hidden partitions are skipped as well.
+ * Once the last partition is passed, the package header crc is checked.
+ *
+ * @param[in] rd the reader.
+ * @param[out] type the partition type.
+ * @param[out] size the partition size (stored size for sparse partitions).
+ * @param[out] crc the partition data crc.
+ * @param[out] hw_id the partition hardware id.
+ * @return
+ *  - 0 on success.
+ *  - 1 at the end of the package, once its header crc is verified.
+ *  - -1 on header crc mismatch (EBADMSG).
+ *  - -2 on format error (EILSEQ).
+ *  - -3 on read error or truncated package (EIO).
+ */
+EXPORT int bpk_reader_next(
+        bpk_reader *rd,
+        bpk_type *type,
+        bpk_size *size,
+        uint32_t *crc,
+        uint32_t *hw_id);
+
+/**
+ * @brief read the current partition of a reader.
+ * @details the partition checksum is verified once all its data is read,
+ * the partition must be read until 0 is returned to know it's valid.
+ * Sparse partitions can't be read from a stream, only skipped.
+ *
+ * @param[in] rd the reader.
+ * @param[out] buf the buffer to fill.
+ * @param[in] size the size of buf.
+ * @return
+ *  - the number of bytes read.
+ *  - 0 at the end of the partition, once its checksum is verified.
+ *  - -1 on error (setting errno: EBADMSG on checksum mismatch, EIO if the
+ *  package is truncated, EOPNOTSUPP for sparse partitions and unknown
+ *  checksum algorithms).
+ */
+EXPORT ssize_t bpk_reader_read(bpk_reader *rd, void *buf, size_t size);
+
 /**
  * @}
  */
@@ -27,17 +27,45 @@
 #define __BPK_PRIV_H__
 
 #include <stdint.h>
-#include <stdio.h>
+#include <sys/types.h>
+
+#include "index.h"
+#include "cksum.h"
 
 #define BPK_MAJOR(ver) (ver & 0xFFFF0000)
-#define BPK_VERSION 0x00010000 /* 1.0 */
+#define BPK_VERSION_1_0 0x00010000 /* 1.0 */
+#define BPK_VERSION_CKSUM 0x00010001 /* 1.1: bpk_part.spare is the checksum type */
+#define BPK_VERSION_TOC 0x00010002 /* 1.2: bpk_header.spare is the toc offset */
+#define BPK_VERSION_SPARSE 0x00020000 /* 2.0: sparse partitions */
+#define BPK_VERSION BPK_VERSION_SPARSE /* highest supported version */
 
 #define BPK_MAGIC 0x534F4659 /* SOFY */
 
 #define FLAG_CRC 0x01 /* compute crc and len when closing the file */
+#define FLAG_HCRC 0x02 /* hcrc is up to date */
+#define FLAG_TOC 0x04 /* write a table of contents when closing the file */
+#define FLAG_TRUNC 0x08 /* truncate the file when closing it */
+#define FLAG_SPARSE 0x10 /* leave holes out of the new partitions */
+#define FLAG_PREALLOC 0x20 /* some space is reserved after the end */
+#define FLAG_USER_IO 0x40 /* bpk_open_ops backend: synced, left open */
 
 #define BPK_CRC_SEED 0x0U
 
+#define BPK_MT_MIN_RANGE (1024 * 1024) /* minimum range per crc thread */
+#define BPK_MT_BUFF_SIZE (128 * 1024) /* crc threads read buffer size */
+#define BPK_BUFF_SIZE (128 * 1024) /* default I/O buffer size */
+#define BPK_SCAN_WINDOW (256 * 1024) /* partition headers read size */
+#define BPK_COPY_CHUNK (4 * 1024 * 1024) /* bpk_write in-kernel copy size */
+#define BPK_COPY_MAX (1024 * 1024 * 1024) /* largest in-kernel copy call */
+#define BPK_DIRECT_ALIGN 4096 /* O_DIRECT buffers and offsets alignment */
+#define BPK_DIRECT_BLOCK (1024 * 1024) /* default O_DIRECT block size */
+#define BPK_SPARSE_BLOCK 4096 /* zero blocks detection granularity */
+#define BPK_SIZE_UNKNOWN ((bpk_size) -1) /* partition size not known yet */
+#define BPK_STREAM_MAX (64 * 1024 * 1024) /* streamed parts buffered data */
+
+#define BPK_PART_SPARSE 0x80000000 /* bpk_part.spare flag: extent encoded */
+#define BPK_SPARSE_MAGIC 0x53505253 /* SPRS */
+
 typedef struct __attribute__((packed)) {
     uint32_t magic;
     uint32_t version;
@@ -54,12 +82,146 @@ typedef struct __attribute__((packed)) {
     uint32_t spare;
 } bpk_part;
 
+typedef struct __attribute__((packed)) {
+    bpk_type type;
+    uint32_t hw_id;
+    uint64_t offset; /**!< partition data offset */
+    bpk_size size;
+    uint32_t crc;
+    uint32_t cksum;
+} bpk_toc_entry;
+
+/**
+ * @brief sparse partition extent, as stored in the extent table.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t offset; /**!< logical offset of the data */
+    uint64_t size;
+} bpk_extent;
+
+/**
+ * @brief sparse partition trailer.
+ * @details the data of sparse partitions is made of the data extents stored
+ * back to back, followed by the extent table and this trailer. The ranges
+ * between extents are holes, read as zeros.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t size; /**!< logical size of the partition */
+    uint32_t count; /**!< number of extents */
+    uint32_t magic;
+} bpk_sparse_trailer;
+
+/**
+ * @brief in-memory extent list of a sparse partition.
+ */
+typedef struct {
+    bpk_size size; /**!< logical size of the partition */
+    size_t count;
+    size_t alloc;
+    struct {
+        bpk_size offset; /**!< logical offset */
+        bpk_size size;
+        bpk_size data; /**!< offset of the data in the partition */
+    } *ext;
+} bpk_sparse;
+
+/**
+ * @brief partition queued in a streamed package.
+ * @details files are read twice when the package is written, once to
+ * compute their checksum, once to copy them, other inputs are buffered.
+ */
+typedef struct bpk_stream_part {
+    bpk_type type;
+    uint32_t hw_id;
+    bpk_cksum cksum;
+    size_t align; /**!< data alignment when the part was added */
+    char *file; /**!< input file, NULL for buffered data */
+    unsigned char *data; /**!< buffered data */
+    bpk_size size;
+    uint32_t crc;
+    struct bpk_stream_part *next;
+} bpk_stream_part;
+
+/**
+ * @brief parts of a package written to a non-seekable output.
+ */
+typedef struct {
+    bpk_stream_part *head;
+    bpk_stream_part **tail;
+    size_t buffered; /**!< size of the buffered data */
+} bpk_stream;
+
 struct bpk {
-    FILE *fd; /**! bpk filedescriptor */
+    int fd; /**! bpk filedescriptor, -1 for other backends */
+    const bpk_io_ops *ops; /**!< storage backend */
+    void *io; /**!< backend argument */
+    unsigned char *buff; /**!< I/O buffer, allocated on first use */
+    size_t buff_size; /**!< size of the I/O buffer */
+    unsigned char *win; /**!< partition headers read window */
+    off_t win_off; /**!< offset of the window */
+    size_t win_len; /**!< valid bytes in the window */
+    const unsigned char *map; /**!< read-only mapping (BPK_OPEN_MMAP) */
+    size_t map_size; /**!< size of the mapping */
+    bpk_index *index; /**!< partition index (BPK_OPEN_INDEX) */
+    size_t pidx; /**!< index of the next partition */
+    off_t next; /**!< offset of the next partition header */
+    off_t poff; /**!< offset of the current partition data */
     off_t ppos; /**!< position in the current partition */
     off_t psize; /**!< size of the current partition */
+    uint32_t pcrc; /**!< checksum of the current partition */
+    bpk_sparse *psparse; /**!< extents of the current partition, if sparse */
     off_t size; /**!< total size of the bpk file */
+    off_t toc; /**!< table of contents partition offset, 0 if none */
+    size_t align; /**!< data alignment of new parts, 0 for none */
     uint8_t flags; /**!< internal flags */
+    uint32_t version; /**!< lowest version the new parts need */
+    uint32_t hcrc; /**!< crc of the partition headers (FLAG_HCRC) */
+    uint64_t hlen; /**!< length of the partition headers */
+    bpk_cksum cksum; /**!< checksum algorithm for new parts */
+    bpk_cksum pcksum; /**!< checksum algorithm of the current partition */
+    bpk_stream *stream; /**!< queued parts (bpk_create_stream) */
+};
+
+/**
+ * @brief read cursor over a read-only bpk file.
+ * @details cursors only use the partition index and positional reads, so
+ * that they can be used concurrently on the same bpk file.
+ */
+struct bpk_cursor {
+    bpk *parent; /**!< the bpk file, must not be modified */
+    unsigned char *buff; /**!< checksum buffer, allocated on first use */
+    size_t buff_size; /**!< size of the checksum buffer */
+    size_t pidx; /**!< index of the next partition */
+    off_t poff; /**!< offset of the current partition data */
+    off_t ppos; /**!< position in the current partition */
+    off_t psize; /**!< size of the current partition */
+    bpk_cksum pcksum; /**!< checksum algorithm of the current partition */
+    bpk_sparse *psparse; /**!< extents of the current partition, if sparse */
+};
+
+/**
+ * @brief forward-only reader over a package stream.
+ * @details the package is read once, through a fixed size buffer, the
+ * checksums are computed as the data goes by.
+ */
+struct bpk_reader {
+    bpk_fill_func func; /**!< input function */
+    void *func_arg;
+    int fd; /**!< input file (bpk_reader_new) */
+    unsigned char *buff; /**!< read-ahead buffer */
+    size_t buff_size; /**!< size of the read-ahead buffer */
+    size_t buff_pos; /**!< first unread byte in the buffer */
+    size_t buff_len; /**!< valid bytes in the buffer */
+    uint64_t size; /**!< package size, from its header */
+    uint64_t pos; /**!< position in the package */
+    uint32_t crc; /**!< header crc, from the package header */
+    uint32_t hcrc; /**!< crc of the headers read so far */
+    int status; /**!< 1 once the package is read, < 0 on error */
+    bpk_size left; /**!< unread data of the current partition */
+    uint32_t pcrc; /**!< checksum of the current partition */
+    int psparse; /**!< current partition is sparse */
+    int pcheck; /**!< current partition checksum algorithm is supported */
+    bpk_cksum_ctx ctx; /**!< current partition data checksum */
 };
 
 #endif
@@ -0,0 +1,82 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** cksum.c
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#include "bpk.h"
+#include "bpk_priv.h"
+#include "cksum.h"
+#include "crc32.h"
+
+int bpk_cksum_init(bpk_cksum_ctx *ctx, bpk_cksum algo)
+{
+    ctx->algo = algo;
+    ctx->crc = BPK_CRC_SEED;
+
+    switch (algo)
+    {
+        case BPK_CKSUM_CRC32:
+        case BPK_CKSUM_CRC32C:
+            return 0;
+        case BPK_CKSUM_XXH3:
+            bpk_xxh3_init(&ctx->xxh);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+void bpk_cksum_update(bpk_cksum_ctx *ctx, const void *data, size_t len)
+{
+    switch (ctx->algo)
+    {
+        case BPK_CKSUM_CRC32:
+            ctx->crc = bpk_crc32(data, len, ctx->crc);
+            break;
+        case BPK_CKSUM_CRC32C:
+            ctx->crc = bpk_crc32c(data, len, ctx->crc);
+            break;
+        case BPK_CKSUM_XXH3:
+            bpk_xxh3_update(&ctx->xxh, data, len);
+            break;
+    }
+}
+
+uint32_t bpk_cksum_final(const bpk_cksum_ctx *ctx)
+{
+    if (ctx->algo == BPK_CKSUM_XXH3)
+        return (uint32_t) bpk_xxh3_digest(&ctx->xxh);
+    return ctx->crc;
+}
+
+bpk_cksum_combine_func bpk_cksum_combiner(bpk_cksum algo)
+{
+    switch (algo)
+    {
+        case BPK_CKSUM_CRC32:
+            return bpk_crc32_combine;
+        case BPK_CKSUM_CRC32C:
+            return bpk_crc32c_combine;
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,77 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** cksum.h
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#ifndef __CKSUM_H__
+#define __CKSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bpk.h"
+#include "xxh3.h"
+
+BEGIN_DECLS
+
+/**
+ * @brief partition data checksum context.
+ */
+typedef struct {
+    bpk_cksum algo;
+    uint32_t crc;
+    xxh3_state xxh;
+} bpk_cksum_ctx;
+
+typedef uint32_t (*bpk_cksum_combine_func)(uint32_t crc_a, uint32_t crc_b,
+        bpk_size len_b);
+
+/**
+ * @brief initialize a checksum context.
+ * @param[out] ctx the context to initialize.
+ * @param[in] algo the checksum algorithm.
+ * @return
+ *  - 0 on success.
+ *  - -1 if the algorithm is not supported.
+ */
+int bpk_cksum_init(bpk_cksum_ctx *ctx, bpk_cksum algo);
+
+/**
+ * @brief feed a checksum context.
+ */
+void bpk_cksum_update(bpk_cksum_ctx *ctx, const void *data, size_t len);
+
+/**
+ * @brief get the checksum of the data fed to a context.
+ */
+uint32_t bpk_cksum_final(const bpk_cksum_ctx *ctx);
+
+/**
+ * @brief get the combination function for an algorithm.
+ * @return
+ *  - NULL if the algorithm results can't be combined.
+ */
+bpk_cksum_combine_func bpk_cksum_combiner(bpk_cksum algo);
+
+END_DECLS
+
+#endif
@@ -42,8 +42,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "bpk.h"
 #include "crc32.h"
+#include "compat/endian.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CRC32_PCLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
 
 static const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -100,13 +110,461 @@ static const uint32_t crc32_table[256] = {
 	0x2d02ef8dL
 };
 
-uint32_t bpk_crc32(const void *data, size_t len, uint32_t seed)
+/*
+ * Slicing-by-8 tables: crc32_slice_table[0] is crc32_table, entry [k][n] is
+ * the crc of byte n followed by k zero bytes, so that 8 input bytes can be
+ * folded into the crc with 8 independent lookups.
+ */
+static uint32_t crc32_slice_table[8][256];
+
+/* x^(2^n) modulo the crc polynomial, for crc combination */
+static uint32_t crc32_x2n_table[32];
+
+/* crc32c (Castagnoli, polynomial $82f63b78) slicing and combination tables */
+#define CRC32C_POLY 0x82F63B78U
+static uint32_t crc32c_slice_table[8][256];
+static uint32_t crc32c_x2n_table[32];
+
+uint32_t bpk_crc32_bytewise(const void *data, size_t len, uint32_t seed)
 {
 	const unsigned char *s = data;
 
-        seed = seed ^ 0xFFFFFFFFU;
+	seed = seed ^ 0xFFFFFFFFU;
 	while (len-- > 0)
 		seed = crc32_table[(seed ^ *s++) & 0xff] ^ (seed >> 8);
 	return seed ^ 0xFFFFFFFFU;
 }
 
+uint32_t bpk_crc32_slice8(const void *data, size_t len, uint32_t seed)
+{
+	const unsigned char *s = data;
+	uint32_t (*t)[256] = crc32_slice_table;
+	uint32_t one, two;
+
+	seed = seed ^ 0xFFFFFFFFU;
+	while (len != 0 && ((uintptr_t) s & 7) != 0)
+	{
+		seed = t[0][(seed ^ *s++) & 0xff] ^ (seed >> 8);
+		--len;
+	}
+
+	while (len >= 8)
+	{
+		memcpy(&one, s, sizeof (uint32_t));
+		memcpy(&two, s + 4, sizeof (uint32_t));
+		one = le32toh(one) ^ seed;
+		two = le32toh(two);
+
+		seed = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+			t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+			t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+			t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		seed = t[0][(seed ^ *s++) & 0xff] ^ (seed >> 8);
+	return seed ^ 0xFFFFFFFFU;
+}
+
+#if defined(HAVE_CRC32_PCLMUL)
+/*
+ * Folding constants for the reflected 0xEDB88320 polynomial, see Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ */
+static const uint64_t __attribute__((aligned(16))) crc32_k1k2[] =
+	{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const uint64_t __attribute__((aligned(16))) crc32_k3k4[] =
+	{ 0x01751997d0ULL, 0x00ccaa009eULL };
+static const uint64_t __attribute__((aligned(16))) crc32_k5k0[] =
+	{ 0x0163cd6124ULL, 0x0000000000ULL };
+static const uint64_t __attribute__((aligned(16))) crc32_poly[] =
+	{ 0x01db710641ULL, 0x01f7011641ULL };
+
+/*
+ * Fold a buffer whose length is a multiple of 16 and at least 64 bytes,
+ * crc being the inverted (internal) crc register value.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(const unsigned char *s, size_t len,
+		uint32_t crc)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (s + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (s + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (s + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (s + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *) crc32_k1k2);
+	s += 64;
+	len -= 64;
+
+	/* fold 4 x 128 bits at a time */
+	while (len >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (s + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (s + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (s + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (s + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		s += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *) crc32_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* remaining 16 bytes blocks */
+	while (len >= 16)
+	{
+		x2 = _mm_loadu_si128((const __m128i *) s);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		s += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) crc32_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *) crc32_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static int crc32_has_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return 0;
+	return ((ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) ? 1 : 0;
+}
+
+uint32_t bpk_crc32_pclmul(const void *data, size_t len, uint32_t seed)
+{
+	const unsigned char *s = data;
+	size_t chunk;
+
+	if (len < 64)
+		return bpk_crc32_slice8(data, len, seed);
+
+	chunk = len & ~((size_t) 15);
+	seed = crc32_fold_pclmul(s, chunk, seed ^ 0xFFFFFFFFU) ^ 0xFFFFFFFFU;
+	return bpk_crc32_slice8(s + chunk, len - chunk, seed);
+}
+#else
+static int crc32_has_pclmul(void)
+{
+	return 0;
+}
+
+uint32_t bpk_crc32_pclmul(const void *data, size_t len, uint32_t seed)
+{
+	return bpk_crc32_slice8(data, len, seed);
+}
+#endif
+
+static const struct {
+	const char *name;
+	bpk_crc32_func func;
+	int (*supported)(void);
+} crc32_impls[] = {
+	{ "bytewise", bpk_crc32_bytewise, NULL },
+	{ "slice8", bpk_crc32_slice8, NULL },
+	{ "pclmul", bpk_crc32_pclmul, crc32_has_pclmul },
+};
+#define crc32_impls_size (sizeof (crc32_impls) / sizeof (crc32_impls[0]))
+
+/* default implementation until crc32_init is called */
+static unsigned int crc32_impl = 1;
+
+int bpk_crc32_set_impl(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < crc32_impls_size; ++i)
+	{
+		if (strcmp(crc32_impls[i].name, name) == 0)
+		{
+			if (crc32_impls[i].supported != NULL &&
+					!crc32_impls[i].supported())
+				return -1;
+			crc32_impl = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *bpk_crc32_get_impl(void)
+{
+	return crc32_impls[crc32_impl].name;
+}
+
+/*
+ * Multiply a and b modulo poly, all being reflected polynomials (x^0 being
+ * the MSB).
+ */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b, uint32_t poly)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) modulo poly, x2n_table being poly's x^(2^n) table */
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned int k,
+		const uint32_t *x2n_table, uint32_t poly)
+{
+	uint32_t p = 1U << 31; /* x^0 */
+
+	while (n != 0)
+	{
+		if (n & 1)
+			p = crc32_multmodp(x2n_table[k & 31], p, poly);
+		n >>= 1;
+		++k;
+	}
+	return p;
+}
+
+uint32_t bpk_crc32_combine(uint32_t crc_a, uint32_t crc_b, bpk_size len_b)
+{
+	/* shift crc_a by len_b bytes (len_b * 2^3 bits) */
+	return crc32_multmodp(
+			crc32_x2nmodp(len_b, 3, crc32_x2n_table, 0xEDB88320U),
+			crc_a, 0xEDB88320U) ^ crc_b;
+}
+
+uint32_t bpk_crc32c_combine(uint32_t crc_a, uint32_t crc_b, bpk_size len_b)
+{
+	return crc32_multmodp(
+			crc32_x2nmodp(len_b, 3, crc32c_x2n_table, CRC32C_POLY),
+			crc_a, CRC32C_POLY) ^ crc_b;
+}
+
+uint32_t bpk_crc32c_slice8(const void *data, size_t len, uint32_t seed)
+{
+	const unsigned char *s = data;
+	uint32_t (*t)[256] = crc32c_slice_table;
+	uint32_t one, two;
+
+	seed = seed ^ 0xFFFFFFFFU;
+	while (len != 0 && ((uintptr_t) s & 7) != 0)
+	{
+		seed = t[0][(seed ^ *s++) & 0xff] ^ (seed >> 8);
+		--len;
+	}
+
+	while (len >= 8)
+	{
+		memcpy(&one, s, sizeof (uint32_t));
+		memcpy(&two, s + 4, sizeof (uint32_t));
+		one = le32toh(one) ^ seed;
+		two = le32toh(two);
+
+		seed = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+			t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+			t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+			t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		seed = t[0][(seed ^ *s++) & 0xff] ^ (seed >> 8);
+	return seed ^ 0xFFFFFFFFU;
+}
+
+#if defined(HAVE_CRC32_PCLMUL)
+static int crc32c_has_sse42(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return 0;
+	return (ecx & bit_SSE4_2) ? 1 : 0;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t bpk_crc32c_sse42(const void *data, size_t len, uint32_t seed)
+{
+	const unsigned char *s = data;
+	uint32_t crc = seed ^ 0xFFFFFFFFU;
+	uint32_t v32;
+#if defined(__x86_64__)
+	uint64_t crc64, v64;
+#endif
+
+	while (len != 0 && ((uintptr_t) s & 7) != 0)
+	{
+		crc = _mm_crc32_u8(crc, *s++);
+		--len;
+	}
+
+#if defined(__x86_64__)
+	crc64 = crc;
+	while (len >= 8)
+	{
+		memcpy(&v64, s, sizeof (uint64_t));
+		crc64 = _mm_crc32_u64(crc64, v64);
+		s += 8;
+		len -= 8;
+	}
+	crc = (uint32_t) crc64;
+#endif
+
+	while (len >= 4)
+	{
+		memcpy(&v32, s, sizeof (uint32_t));
+		crc = _mm_crc32_u32(crc, v32);
+		s += 4;
+		len -= 4;
+	}
+
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *s++);
+	return crc ^ 0xFFFFFFFFU;
+}
+#else
+static int crc32c_has_sse42(void)
+{
+	return 0;
+}
+
+uint32_t bpk_crc32c_sse42(const void *data, size_t len, uint32_t seed)
+{
+	return bpk_crc32c_slice8(data, len, seed);
+}
+#endif
+
+/* selected by crc32_init */
+static bpk_crc32_func crc32c_impl = bpk_crc32c_slice8;
+
+uint32_t bpk_crc32c(const void *data, size_t len, uint32_t seed)
+{
+	return crc32c_impl(data, len, seed);
+}
+
+/*
+ * Builds the slicing tables and selects the fastest implementation
+ * available, BPK_CRC32 environment variable may force a given one for the
+ * crc32.
+ */
+static void __attribute__((constructor)) crc32_init(void)
+{
+	unsigned int n, k;
+	uint32_t c;
+	const char *env;
+
+	for (n = 0; n < 256; ++n)
+	{
+		c = crc32_table[n];
+		crc32_slice_table[0][n] = c;
+		for (k = 1; k < 8; ++k)
+		{
+			c = crc32_table[c & 0xff] ^ (c >> 8);
+			crc32_slice_table[k][n] = c;
+		}
+	}
+
+	for (n = 0; n < 256; ++n)
+	{
+		c = n;
+		for (k = 0; k < 8; ++k)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_slice_table[0][n] = c;
+	}
+	for (n = 0; n < 256; ++n)
+	{
+		c = crc32c_slice_table[0][n];
+		for (k = 1; k < 8; ++k)
+		{
+			c = crc32c_slice_table[0][c & 0xff] ^ (c >> 8);
+			crc32c_slice_table[k][n] = c;
+		}
+	}
+
+	c = 0x40000000U; /* x^1 */
+	crc32_x2n_table[0] = crc32c_x2n_table[0] = c;
+	for (n = 1; n < 32; ++n)
+		crc32_x2n_table[n] = c = crc32_multmodp(c, c, 0xEDB88320U);
+	c = 0x40000000U;
+	for (n = 1; n < 32; ++n)
+		crc32c_x2n_table[n] = c = crc32_multmodp(c, c, CRC32C_POLY);
+
+	if (crc32c_has_sse42())
+		crc32c_impl = bpk_crc32c_sse42;
+
+	env = getenv("BPK_CRC32");
+	if (env == NULL || bpk_crc32_set_impl(env) != 0)
+	{
+		if (bpk_crc32_set_impl("pclmul") != 0)
+			bpk_crc32_set_impl("slice8");
+	}
+}
+
+uint32_t bpk_crc32(const void *data, size_t len, uint32_t seed)
+{
+	return crc32_impls[crc32_impl].func(data, len, seed);
+}
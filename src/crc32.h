@@ -27,8 +27,92 @@
 #define __CRC32_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief compute a crc32 (polynomial 0xEDB88320).
+ * @param[in] data the data to checksum.
+ * @param[in] len the data length.
+ * @param[in] seed previous crc value (BPK_CRC_SEED to start a new one).
+ * @return the updated crc.
+ */
 uint32_t bpk_crc32(const void *data, size_t len, uint32_t seed);
 
+/**
+ * @brief reference byte-wise crc32 implementation.
+ */
+uint32_t bpk_crc32_bytewise(const void *data, size_t len, uint32_t seed);
+
+/**
+ * @brief slicing-by-8 crc32 implementation.
+ */
+uint32_t bpk_crc32_slice8(const void *data, size_t len, uint32_t seed);
+
+/**
+ * @brief carry-less multiplication folding crc32 implementation.
+ * @details falls back on bpk_crc32_slice8 on non-x86 platforms, must not be
+ * called directly if bpk_crc32_set_impl("pclmul") fails.
+ */
+uint32_t bpk_crc32_pclmul(const void *data, size_t len, uint32_t seed);
+
+typedef uint32_t (*bpk_crc32_func)(const void *data, size_t len,
+        uint32_t seed);
+
+/**
+ * @brief force the implementation used by bpk_crc32.
+ * @details the fastest supported implementation is selected when the library
+ * is loaded, unless the BPK_CRC32 environment variable names another one.
+ * Internal to the library (not exported), like the functions above, the
+ * BPK_CRC32 environment variable is the public way to select it.
+ *
+ * @param[in] name "bytewise", "slice8" or "pclmul".
+ * @return
+ *  - 0 on success.
+ *  - -1 if the implementation is unknown or not supported by this cpu.
+ */
+int bpk_crc32_set_impl(const char *name);
+
+/**
+ * @brief get the name of the implementation used by bpk_crc32.
+ * @details internal to the library, see bpk_crc32_set_impl.
+ */
+const char *bpk_crc32_get_impl(void);
+
+/**
+ * @brief compute a crc32c (Castagnoli polynomial 0x82F63B78).
+ * @details uses the SSE4.2 crc32 instruction when available.
+ *
+ * @param[in] data the data to checksum.
+ * @param[in] len the data length.
+ * @param[in] seed previous crc value (BPK_CRC_SEED to start a new one).
+ * @return the updated crc.
+ */
+uint32_t bpk_crc32c(const void *data, size_t len, uint32_t seed);
+
+/**
+ * @brief slicing-by-8 crc32c implementation.
+ */
+uint32_t bpk_crc32c_slice8(const void *data, size_t len, uint32_t seed);
+
+/**
+ * @brief SSE4.2 crc32c implementation.
+ * @details falls back on bpk_crc32c_slice8 on non-x86 platforms, must not be
+ * called on x86 cpus without SSE4.2.
+ */
+uint32_t bpk_crc32c_sse42(const void *data, size_t len, uint32_t seed);
+
+/**
+ * @brief combine two crc32c, see bpk_crc32_combine.
+ */
+uint32_t bpk_crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+#if defined(__cplusplus)
+}
+#endif
+
 #endif
 
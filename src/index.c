@@ -0,0 +1,148 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** index.c
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#include <stdlib.h>
+
+#include "bpk.h"
+#include "index.h"
+
+#define INDEX_MIN_SLOTS 64
+
+/**
+ * @brief hash a (type, hw_id) key.
+ */
+static uint32_t bpk_index_hash(bpk_type type, uint32_t hw_id)
+{
+    uint64_t h = ((uint64_t) type << 32) | hw_id;
+
+    /* splitmix64 finalizer */
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return (uint32_t) h;
+}
+
+/**
+ * @brief insert an entry in the hash table, earlier entries win.
+ */
+static void bpk_index_insert(bpk_index *idx, size_t pos)
+{
+    const bpk_index_entry *e = &idx->parts[pos];
+    size_t mask = idx->slots_size - 1;
+    size_t i = bpk_index_hash(e->type, e->hw_id) & mask;
+
+    while (idx->slots[i] != 0)
+    {
+        const bpk_index_entry *cur = &idx->parts[idx->slots[i] - 1];
+
+        if (cur->type == e->type && cur->hw_id == e->hw_id)
+            return;
+        i = (i + 1) & mask;
+    }
+    idx->slots[i] = pos + 1;
+}
+
+/**
+ * @brief resize and rebuild the hash table.
+ */
+static int bpk_index_rehash(bpk_index *idx, size_t slots_size)
+{
+    uint32_t *slots;
+    size_t i;
+
+    slots = calloc(slots_size, sizeof (uint32_t));
+    if (slots == NULL)
+        return -1;
+
+    free(idx->slots);
+    idx->slots = slots;
+    idx->slots_size = slots_size;
+    for (i = 0; i < idx->count; ++i)
+        bpk_index_insert(idx, i);
+    return 0;
+}
+
+bpk_index *bpk_index_new(void)
+{
+    bpk_index *idx = calloc(1, sizeof (bpk_index));
+
+    if (idx != NULL && bpk_index_rehash(idx, INDEX_MIN_SLOTS) != 0)
+    {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+void bpk_index_free(bpk_index *idx)
+{
+    if (idx == NULL)
+        return;
+    free(idx->parts);
+    free(idx->slots);
+    free(idx);
+}
+
+int bpk_index_add(bpk_index *idx, const bpk_index_entry *entry)
+{
+    bpk_index_entry *parts;
+    size_t alloc;
+
+    if (idx->count == idx->alloc)
+    {
+        alloc = (idx->alloc != 0) ? idx->alloc * 2 : 16;
+        parts = realloc(idx->parts, alloc * sizeof (bpk_index_entry));
+        if (parts == NULL)
+            return -1;
+        idx->parts = parts;
+        idx->alloc = alloc;
+    }
+
+    /* keep the load factor under 1/2 */
+    if ((idx->count + 1) * 2 > idx->slots_size &&
+            bpk_index_rehash(idx, idx->slots_size * 2) != 0)
+        return -1;
+
+    idx->parts[idx->count] = *entry;
+    bpk_index_insert(idx, idx->count++);
+    return 0;
+}
+
+ssize_t bpk_index_find(const bpk_index *idx, bpk_type type, uint32_t hw_id)
+{
+    size_t mask = idx->slots_size - 1;
+    size_t i = bpk_index_hash(type, hw_id) & mask;
+
+    while (idx->slots[i] != 0)
+    {
+        const bpk_index_entry *cur = &idx->parts[idx->slots[i] - 1];
+
+        if (cur->type == type && cur->hw_id == hw_id)
+            return idx->slots[i] - 1;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
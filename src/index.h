@@ -0,0 +1,91 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** index.h
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "bpk.h"
+
+BEGIN_DECLS
+
+/**
+ * @brief partition index entry.
+ */
+typedef struct {
+    bpk_type type;
+    uint32_t hw_id;
+    uint32_t crc;
+    bpk_cksum cksum;
+    off_t offset; /**!< partition data offset */
+    bpk_size size; /**!< stored data size */
+    uint8_t sparse; /**!< extent encoded data */
+} bpk_index_entry;
+
+/**
+ * @brief in-memory partition index.
+ * @details entries are kept in file order, an open addressing hash table
+ * keyed by (type, hw_id) references them for lookups.
+ */
+typedef struct {
+    bpk_index_entry *parts; /**!< entries in file order */
+    size_t count;
+    size_t alloc;
+    uint32_t *slots; /**!< entry index + 1, 0 for empty slots */
+    size_t slots_size; /**!< hash table size, a power of two */
+} bpk_index;
+
+/**
+ * @brief create an empty index.
+ * @return the index or NULL on allocation failure.
+ */
+bpk_index *bpk_index_new(void);
+
+/**
+ * @brief release an index.
+ */
+void bpk_index_free(bpk_index *idx);
+
+/**
+ * @brief add an entry at the end of an index.
+ * @return
+ *  - 0 on success.
+ *  - -1 on allocation failure.
+ */
+int bpk_index_add(bpk_index *idx, const bpk_index_entry *entry);
+
+/**
+ * @brief find the first entry matching type and hw_id.
+ * @return
+ *  - the entry position in idx->parts.
+ *  - -1 if not found.
+ */
+ssize_t bpk_index_find(const bpk_index *idx, bpk_type type, uint32_t hw_id);
+
+END_DECLS
+
+#endif
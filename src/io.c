@@ -0,0 +1,242 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** io.c
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "bpk.h"
+#include "io.h"
+
+/**
+ * @brief growable memory buffer.
+ */
+struct bpk_mem {
+    unsigned char *data;
+    size_t size; /**!< used bytes */
+    size_t alloc; /**!< allocated bytes */
+};
+
+#define MEM_MIN_ALLOC 4096
+
+ssize_t bpk_pread_fd(int fd, void *buf, size_t len, off_t off)
+{
+    ssize_t ret = 0, rlen;
+
+    while (len != 0)
+    {
+        rlen = pread(fd, (unsigned char *) buf + ret, len, off + ret);
+        if (rlen < 0 && errno == EINTR)
+            continue;
+        else if (rlen < 0)
+            return -1;
+        else if (rlen == 0)
+            break;
+        ret += rlen;
+        len -= rlen;
+    }
+    return ret;
+}
+
+int bpk_pwrite_fd(int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t wlen;
+
+    while (len != 0)
+    {
+        wlen = pwrite(fd, buf, len, off);
+        if (wlen < 0 && errno == EINTR)
+            continue;
+        else if (wlen <= 0)
+        {
+            if (wlen == 0)
+                errno = EIO;
+            return -1;
+        }
+        buf = (const unsigned char *) buf + wlen;
+        off += wlen;
+        len -= wlen;
+    }
+    return 0;
+}
+
+static ssize_t bpk_fd_read_at(void *io, void *buf, size_t len, bpk_size off)
+{
+    return bpk_pread_fd(*(int *) io, buf, len, off);
+}
+
+static int bpk_fd_write_at(
+        void *io,
+        const void *buf,
+        size_t len,
+        bpk_size off)
+{
+    return bpk_pwrite_fd(*(int *) io, buf, len, off);
+}
+
+static int bpk_fd_size(void *io, bpk_size *size)
+{
+    struct stat st;
+
+    if (fstat(*(int *) io, &st) != 0)
+        return -1;
+    *size = st.st_size;
+    return 0;
+}
+
+static int bpk_fd_truncate(void *io, bpk_size size)
+{
+    return ftruncate(*(int *) io, size);
+}
+
+static int bpk_fd_sync(void *io)
+{
+    return fsync(*(int *) io);
+}
+
+const bpk_io_ops bpk_io_fd = {
+    bpk_fd_read_at,
+    bpk_fd_write_at,
+    bpk_fd_size,
+    bpk_fd_truncate,
+    bpk_fd_sync
+};
+
+/**
+ * @brief make room in a memory buffer.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+static int bpk_mem_reserve(bpk_mem *mem, bpk_size size)
+{
+    unsigned char *data;
+    size_t alloc;
+
+    if (size <= mem->alloc)
+        return 0;
+    else if (size > SIZE_MAX / 2)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    for (alloc = (mem->alloc != 0) ? mem->alloc : MEM_MIN_ALLOC;
+            alloc < size; alloc *= 2)
+        ;
+    data = realloc(mem->data, alloc);
+    if (data == NULL)
+        return -1;
+    mem->data = data;
+    mem->alloc = alloc;
+    return 0;
+}
+
+bpk_mem *bpk_mem_new(const void *data, size_t size)
+{
+    bpk_mem *mem = calloc(1, sizeof (bpk_mem));
+
+    if (mem == NULL)
+        return NULL;
+    if (size != 0)
+    {
+        if (bpk_mem_reserve(mem, size) != 0)
+        {
+            free(mem);
+            return NULL;
+        }
+        memcpy(mem->data, data, size);
+        mem->size = size;
+    }
+    return mem;
+}
+
+void bpk_mem_free(bpk_mem *mem)
+{
+    if (mem == NULL)
+        return;
+    free(mem->data);
+    free(mem);
+}
+
+const void *bpk_mem_data(const bpk_mem *mem, size_t *size)
+{
+    if (size != NULL)
+        *size = mem->size;
+    return mem->data;
+}
+
+static ssize_t bpk_mem_read_at(void *io, void *buf, size_t len, bpk_size off)
+{
+    const bpk_mem *mem = io;
+
+    if (off >= mem->size)
+        return 0;
+    if (len > mem->size - off)
+        len = mem->size - off;
+    memcpy(buf, mem->data + off, len);
+    return len;
+}
+
+static int bpk_mem_truncate(void *io, bpk_size size)
+{
+    bpk_mem *mem = io;
+
+    if (bpk_mem_reserve(mem, size) != 0)
+        return -1;
+    if (size > mem->size)
+        memset(mem->data + mem->size, 0, size - mem->size);
+    mem->size = size;
+    return 0;
+}
+
+static int bpk_mem_write_at(
+        void *io,
+        const void *buf,
+        size_t len,
+        bpk_size off)
+{
+    bpk_mem *mem = io;
+
+    if (off + len > mem->size && bpk_mem_truncate(mem, off + len) != 0)
+        return -1;
+    memcpy(mem->data + off, buf, len);
+    return 0;
+}
+
+static int bpk_mem_size(void *io, bpk_size *size)
+{
+    *size = ((const bpk_mem *) io)->size;
+    return 0;
+}
+
+const bpk_io_ops bpk_io_mem = {
+    bpk_mem_read_at,
+    bpk_mem_write_at,
+    bpk_mem_size,
+    bpk_mem_truncate,
+    NULL
+};
@@ -0,0 +1,53 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** io.h
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "bpk.h"
+
+BEGIN_DECLS
+
+/**
+ * @brief read some data at a given offset of a file.
+ * @return
+ *  - the number of bytes read, which is short at the end of file.
+ *  - -1 on error.
+ */
+ssize_t bpk_pread_fd(int fd, void *buf, size_t len, off_t off);
+
+/**
+ * @brief write a whole buffer at a given offset of a file.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set accordingly).
+ */
+int bpk_pwrite_fd(int fd, const void *buf, size_t len, off_t off);
+
+END_DECLS
+
+#endif
@@ -0,0 +1,416 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** xxh3.c
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+/*
+ * Portable implementation of the XXH3 64 bits hash (xxHash 0.8 format,
+ * seed 0 and default secret), see https://github.com/Cyan4973/xxHash.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xxh3.h"
+#include "compat/endian.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+#define SECRET_SIZE_MIN 136
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - XXH3_STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (XXH3_STRIPE_LEN * STRIPES_PER_BLOCK)
+#define BUFFER_STRIPES (XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN)
+
+static const unsigned char xxh3_secret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof (v));
+    return le32toh(v);
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof (v));
+    return le64toh(v);
+}
+
+static inline uint64_t rotl64(uint64_t v, unsigned int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t swap64(uint64_t v)
+{
+    return __builtin_bswap64(v);
+}
+
+static inline uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 p = (uint128) lhs * rhs;
+    return (uint64_t) p ^ (uint64_t) (p >> 64);
+#else
+    uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    h ^= h >> 28;
+    return h;
+}
+
+static uint64_t xxh3_mix16(const unsigned char *in, const unsigned char *sec)
+{
+    return mul128_fold64(read64(in) ^ read64(sec),
+            read64(in + 8) ^ read64(sec + 8));
+}
+
+static uint64_t xxh3_len_0to16(const unsigned char *in, size_t len)
+{
+    const unsigned char *sec = xxh3_secret;
+
+    if (len > 8)
+    {
+        uint64_t lo = read64(in) ^ (read64(sec + 24) ^ read64(sec + 32));
+        uint64_t hi = read64(in + len - 8) ^
+            (read64(sec + 40) ^ read64(sec + 48));
+        return xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+    }
+    else if (len >= 4)
+    {
+        uint64_t in64 = read32(in + len - 4) + ((uint64_t) read32(in) << 32);
+        return xxh3_rrmxmx(in64 ^ (read64(sec + 8) ^ read64(sec + 16)), len);
+    }
+    else if (len > 0)
+    {
+        uint32_t combined = ((uint32_t) in[0] << 16) |
+            ((uint32_t) in[len >> 1] << 24) | in[len - 1] |
+            ((uint32_t) len << 8);
+        return xxh64_avalanche((uint64_t) combined ^
+                (read32(sec) ^ read32(sec + 4)));
+    }
+    return xxh64_avalanche(read64(sec + 56) ^ read64(sec + 64));
+}
+
+static uint64_t xxh3_len_17to128(const unsigned char *in, size_t len)
+{
+    const unsigned char *sec = xxh3_secret;
+    uint64_t acc = len * PRIME64_1;
+
+    if (len > 32)
+    {
+        if (len > 64)
+        {
+            if (len > 96)
+            {
+                acc += xxh3_mix16(in + 48, sec + 96);
+                acc += xxh3_mix16(in + len - 64, sec + 112);
+            }
+            acc += xxh3_mix16(in + 32, sec + 64);
+            acc += xxh3_mix16(in + len - 48, sec + 80);
+        }
+        acc += xxh3_mix16(in + 16, sec + 32);
+        acc += xxh3_mix16(in + len - 32, sec + 48);
+    }
+    acc += xxh3_mix16(in, sec);
+    acc += xxh3_mix16(in + len - 16, sec + 16);
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_len_129to240(const unsigned char *in, size_t len)
+{
+    const unsigned char *sec = xxh3_secret;
+    uint64_t acc = len * PRIME64_1;
+    size_t i, rounds = len / 16;
+
+    for (i = 0; i < 8; ++i)
+        acc += xxh3_mix16(in + 16 * i, sec + 16 * i);
+    acc = xxh3_avalanche(acc);
+
+    for (i = 8; i < rounds; ++i)
+        acc += xxh3_mix16(in + 16 * i, sec + 16 * (i - 8) + 3);
+    acc += xxh3_mix16(in + len - 16, sec + SECRET_SIZE_MIN - 17);
+    return xxh3_avalanche(acc);
+}
+
+static void xxh3_accumulate_512(uint64_t *acc, const unsigned char *in,
+        const unsigned char *sec)
+{
+    unsigned int i;
+    uint64_t val, key;
+
+    for (i = 0; i < 8; ++i)
+    {
+        val = read64(in + 8 * i);
+        key = val ^ read64(sec + 8 * i);
+        acc[i ^ 1] += val;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void xxh3_scramble(uint64_t *acc, const unsigned char *sec)
+{
+    unsigned int i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= read64(sec + 8 * i);
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static void xxh3_accumulate(uint64_t *acc, const unsigned char *in,
+        const unsigned char *sec, size_t stripes)
+{
+    size_t n;
+
+    for (n = 0; n < stripes; ++n)
+        xxh3_accumulate_512(acc, in + n * XXH3_STRIPE_LEN,
+                sec + n * SECRET_CONSUME_RATE);
+}
+
+static uint64_t xxh3_merge(const uint64_t *acc, uint64_t start)
+{
+    const unsigned char *sec = xxh3_secret + SECRET_MERGEACCS_START;
+    uint64_t res = start;
+    unsigned int i;
+
+    for (i = 0; i < 4; ++i)
+        res += mul128_fold64(acc[2 * i] ^ read64(sec + 16 * i),
+                acc[2 * i + 1] ^ read64(sec + 16 * i + 8));
+    return xxh3_avalanche(res);
+}
+
+static void xxh3_init_acc(uint64_t *acc)
+{
+    acc[0] = PRIME32_3;
+    acc[1] = PRIME64_1;
+    acc[2] = PRIME64_2;
+    acc[3] = PRIME64_3;
+    acc[4] = PRIME64_4;
+    acc[5] = PRIME32_2;
+    acc[6] = PRIME64_5;
+    acc[7] = PRIME32_1;
+}
+
+static uint64_t xxh3_long(const unsigned char *in, size_t len)
+{
+    uint64_t acc[8];
+    size_t n, blocks = (len - 1) / BLOCK_LEN;
+
+    xxh3_init_acc(acc);
+    for (n = 0; n < blocks; ++n)
+    {
+        xxh3_accumulate(acc, in + n * BLOCK_LEN, xxh3_secret,
+                STRIPES_PER_BLOCK);
+        xxh3_scramble(acc, xxh3_secret + SECRET_SIZE - XXH3_STRIPE_LEN);
+    }
+
+    xxh3_accumulate(acc, in + blocks * BLOCK_LEN, xxh3_secret,
+            ((len - 1) - blocks * BLOCK_LEN) / XXH3_STRIPE_LEN);
+    xxh3_accumulate_512(acc, in + len - XXH3_STRIPE_LEN,
+            xxh3_secret + SECRET_SIZE - XXH3_STRIPE_LEN - SECRET_LASTACC_START);
+    return xxh3_merge(acc, len * PRIME64_1);
+}
+
+uint64_t bpk_xxh3_64(const void *data, size_t len)
+{
+    const unsigned char *in = data;
+
+    if (len <= 16)
+        return xxh3_len_0to16(in, len);
+    else if (len <= 128)
+        return xxh3_len_17to128(in, len);
+    else if (len <= 240)
+        return xxh3_len_129to240(in, len);
+    return xxh3_long(in, len);
+}
+
+void bpk_xxh3_init(xxh3_state *state)
+{
+    xxh3_init_acc(state->acc);
+    state->buffered = 0;
+    state->stripes = 0;
+    state->total_len = 0;
+}
+
+/* consume stripes, scrambling the accumulators at each block end */
+static void xxh3_consume(uint64_t *acc, size_t *stripes_so_far,
+        const unsigned char *in, size_t stripes)
+{
+    size_t to_end = STRIPES_PER_BLOCK - *stripes_so_far;
+
+    if (to_end <= stripes)
+    {
+        xxh3_accumulate(acc, in,
+                xxh3_secret + *stripes_so_far * SECRET_CONSUME_RATE, to_end);
+        xxh3_scramble(acc, xxh3_secret + SECRET_SIZE - XXH3_STRIPE_LEN);
+        xxh3_accumulate(acc, in + to_end * XXH3_STRIPE_LEN, xxh3_secret,
+                stripes - to_end);
+        *stripes_so_far = stripes - to_end;
+    }
+    else
+    {
+        xxh3_accumulate(acc, in,
+                xxh3_secret + *stripes_so_far * SECRET_CONSUME_RATE, stripes);
+        *stripes_so_far += stripes;
+    }
+}
+
+void bpk_xxh3_update(xxh3_state *state, const void *data, size_t len)
+{
+    const unsigned char *in = data;
+    const unsigned char *end = in + len;
+    size_t load;
+
+    state->total_len += len;
+    if (state->buffered + len <= XXH3_BUFFER_SIZE)
+    {
+        memcpy(state->buffer + state->buffered, in, len);
+        state->buffered += len;
+        return;
+    }
+
+    if (state->buffered != 0)
+    {
+        load = XXH3_BUFFER_SIZE - state->buffered;
+        memcpy(state->buffer + state->buffered, in, load);
+        in += load;
+        xxh3_consume(state->acc, &state->stripes, state->buffer,
+                BUFFER_STRIPES);
+        state->buffered = 0;
+    }
+
+    /* always keep some data buffered for the digest */
+    if ((size_t) (end - in) > XXH3_BUFFER_SIZE)
+    {
+        do
+        {
+            xxh3_consume(state->acc, &state->stripes, in, BUFFER_STRIPES);
+            in += XXH3_BUFFER_SIZE;
+        }
+        while ((size_t) (end - in) > XXH3_BUFFER_SIZE);
+
+        /* last stripe may be needed by the digest */
+        memcpy(state->buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN,
+                in - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+    }
+
+    memcpy(state->buffer, in, end - in);
+    state->buffered = end - in;
+}
+
+uint64_t bpk_xxh3_digest(const xxh3_state *state)
+{
+    unsigned char last[XXH3_STRIPE_LEN];
+    const unsigned char *last_ptr;
+    uint64_t acc[8];
+    size_t stripes, catchup;
+
+    if (state->total_len <= 240)
+        return bpk_xxh3_64(state->buffer, state->total_len);
+
+    memcpy(acc, state->acc, sizeof (acc));
+    if (state->buffered >= XXH3_STRIPE_LEN)
+    {
+        stripes = state->stripes;
+        xxh3_consume(acc, &stripes, state->buffer,
+                (state->buffered - 1) / XXH3_STRIPE_LEN);
+        last_ptr = state->buffer + state->buffered - XXH3_STRIPE_LEN;
+    }
+    else
+    {
+        catchup = XXH3_STRIPE_LEN - state->buffered;
+        memcpy(last, state->buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+        memcpy(last + catchup, state->buffer, state->buffered);
+        last_ptr = last;
+    }
+
+    xxh3_accumulate_512(acc, last_ptr,
+            xxh3_secret + SECRET_SIZE - XXH3_STRIPE_LEN - SECRET_LASTACC_START);
+    return xxh3_merge(acc, state->total_len * PRIME64_1);
+}
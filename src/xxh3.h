@@ -0,0 +1,74 @@
+/*
+** Copyright © (2026), the libbpk contributors.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License as published by the Free Software Foundation; either
+** version 2.1 of the License, or (at your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+** MA 02110-1301 USA
+**
+** xxh3.h
+**
+**        Created on: Oct 16, 2026
+**
+*/
+
+#ifndef __XXH3_H__
+#define __XXH3_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define XXH3_STRIPE_LEN 64
+#define XXH3_BUFFER_SIZE 256
+
+/**
+ * @brief XXH3 64 bits streaming state (seed 0, default secret).
+ */
+typedef struct {
+    uint64_t acc[8];
+    unsigned char buffer[XXH3_BUFFER_SIZE];
+    size_t buffered;
+    size_t stripes;
+    uint64_t total_len;
+} xxh3_state;
+
+/**
+ * @brief compute the XXH3 64 bits hash of a buffer.
+ */
+uint64_t bpk_xxh3_64(const void *data, size_t len);
+
+/**
+ * @brief initialize a streaming XXH3 64 bits state.
+ */
+void bpk_xxh3_init(xxh3_state *state);
+
+/**
+ * @brief feed a streaming XXH3 64 bits state.
+ */
+void bpk_xxh3_update(xxh3_state *state, const void *data, size_t len);
+
+/**
+ * @brief get the hash of the data fed to a streaming state.
+ * @details the state is not modified, more data can be fed afterwards.
+ */
+uint64_t bpk_xxh3_digest(const xxh3_state *state);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
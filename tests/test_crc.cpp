@@ -33,6 +33,8 @@
 
 #include "bpk.h"
 #include "bpk_priv.h"
+#include "crc32.h"
+#include "xxh3.h"
 #include "test_helpers.hpp"
 
 #define SZ_1K (1024)
@@ -43,6 +45,13 @@ class crcTest : public CppUnit::TestFixture
     CPPUNIT_TEST_SUITE(crcTest);
     CPPUNIT_TEST(simple);
     CPPUNIT_TEST(data_crc);
+    CPPUNIT_TEST(slice8);
+    CPPUNIT_TEST(impls);
+    CPPUNIT_TEST(combine);
+    CPPUNIT_TEST(data_crc_mt);
+    CPPUNIT_TEST(crc32c);
+    CPPUNIT_TEST(xxh3);
+    CPPUNIT_TEST(cksum);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -82,6 +91,7 @@ protected:
     char *m_data;
     char *m_sfv;
     bpk *m_bpk;
+    static const char m_data_zero[SZ_1K * 2];
 
     void create()
     {
@@ -172,6 +182,263 @@ protected:
         */
         CPPUNIT_ASSERT_EQUAL((uint32_t) 0xf1e8ba9e, crc);
     }
+
+    void slice8()
+    {
+        unsigned char buf[SZ_1K * 4 + 16];
+        size_t i, off, len;
+        uint32_t crc;
+
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0xcbf43926,
+                bpk_crc32_slice8("123456789", 9, BPK_CRC_SEED));
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_CRC_SEED,
+                bpk_crc32_slice8(buf, 0, BPK_CRC_SEED));
+
+        srand(42);
+        for (i = 0; i < sizeof (buf); ++i)
+            buf[i] = rand() & 0xFF;
+
+        /* unaligned starts and odd lengths */
+        for (off = 0; off < 16; ++off)
+        {
+            for (len = 0; len < 64; ++len)
+                CPPUNIT_ASSERT_EQUAL(
+                        bpk_crc32_bytewise(buf + off, len, BPK_CRC_SEED),
+                        bpk_crc32_slice8(buf + off, len, BPK_CRC_SEED));
+        }
+
+        for (i = 0; i < 64; ++i)
+        {
+            off = rand() % 16;
+            len = rand() % (sizeof (buf) - off);
+            crc = rand();
+            CPPUNIT_ASSERT_EQUAL(bpk_crc32_bytewise(buf + off, len, crc),
+                    bpk_crc32_slice8(buf + off, len, crc));
+        }
+
+        /* chaining must give the same result as a single pass */
+        crc = bpk_crc32_slice8(buf, 1001, BPK_CRC_SEED);
+        crc = bpk_crc32_slice8(buf + 1001, sizeof (buf) - 1001, crc);
+        CPPUNIT_ASSERT_EQUAL(
+                bpk_crc32_bytewise(buf, sizeof (buf), BPK_CRC_SEED), crc);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_crc32(buf, sizeof (buf), BPK_CRC_SEED));
+    }
+
+    void impls()
+    {
+        const char *names[] = { "bytewise", "slice8", "pclmul" };
+        const char *def = bpk_crc32_get_impl();
+        unsigned char *buf = (unsigned char *) malloc(SZ_1K * 64);
+        size_t i, j, off, len;
+        uint32_t ref, crc;
+
+        CPPUNIT_ASSERT(buf);
+        srand(1337);
+        for (i = 0; i < SZ_1K * 64; ++i)
+            buf[i] = rand() & 0xFF;
+
+        CPPUNIT_ASSERT(bpk_crc32_set_impl("unknown") != 0);
+        CPPUNIT_ASSERT(strcmp(def, bpk_crc32_get_impl()) == 0);
+
+        for (i = 0; i < sizeof (names) / sizeof (names[0]); ++i)
+        {
+            if (bpk_crc32_set_impl(names[i]) != 0)
+                continue; /* not supported on this cpu */
+            CPPUNIT_ASSERT(strcmp(names[i], bpk_crc32_get_impl()) == 0);
+
+            for (j = 0; j < 256; ++j)
+            {
+                off = (j < 128) ? j % 16 : rand() % 64;
+                len = (j < 128) ? j : rand() % (SZ_1K * 64 - off);
+                ref = bpk_crc32_bytewise(buf + off, len, j);
+                crc = bpk_crc32(buf + off, len, j);
+                if (ref != crc)
+                {
+                    bpk_crc32_set_impl(def);
+                    free(buf);
+                    CPPUNIT_ASSERT_EQUAL(ref, crc);
+                }
+            }
+        }
+        bpk_crc32_set_impl(def);
+        free(buf);
+    }
+
+    void combine()
+    {
+        unsigned char buf[SZ_1K * 3];
+        size_t i, split;
+        uint32_t ref;
+
+        srand(7);
+        for (i = 0; i < sizeof (buf); ++i)
+            buf[i] = rand() & 0xFF;
+        ref = bpk_crc32(buf, sizeof (buf), BPK_CRC_SEED);
+
+        for (i = 0; i < 32; ++i)
+        {
+            split = (i < 2) ? i * sizeof (buf) : rand() % sizeof (buf);
+            CPPUNIT_ASSERT_EQUAL(ref, bpk_crc32_combine(
+                        bpk_crc32(buf, split, BPK_CRC_SEED),
+                        bpk_crc32(buf + split, sizeof (buf) - split,
+                            BPK_CRC_SEED),
+                        sizeof (buf) - split));
+        }
+    }
+
+    void data_crc_mt()
+    {
+        uint32_t crc;
+        char buf[SZ_1K];
+
+        /* several BPK_MT_MIN_RANGE, with an odd size */
+        int fd = open(m_data, O_WRONLY | O_TRUNC);
+        CPPUNIT_ASSERT(fd >= 0);
+        srand(3);
+        for (int i = 0; i < (5 * SZ_1K) + 3; ++i)
+        {
+            for (size_t j = 0; j < sizeof (buf); ++j)
+                buf[j] = rand() & 0xFF;
+            CPPUNIT_ASSERT(write(fd, buf, sizeof (buf)) ==
+                    (ssize_t) sizeof (buf));
+        }
+        CPPUNIT_ASSERT(write(fd, buf, 17) == 17);
+        close(fd);
+        create();
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(bpk_find(m_bpk, BPK_TYPE_BL, 0, NULL, &crc) == 0);
+
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 4));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 0));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 1));
+
+        /* read pointer must not have moved */
+        bpk_read(m_bpk, buf, 4);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 3));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void crc32c()
+    {
+        unsigned char buf[SZ_1K * 4];
+        size_t i, off, len;
+        uint32_t crc;
+
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0xe3069283,
+                bpk_crc32c("123456789", 9, BPK_CRC_SEED));
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0xe3069283,
+                bpk_crc32c_slice8("123456789", 9, BPK_CRC_SEED));
+
+        srand(11);
+        for (i = 0; i < sizeof (buf); ++i)
+            buf[i] = rand() & 0xFF;
+
+        for (i = 0; i < 128; ++i)
+        {
+            off = i % 16;
+            len = (i < 64) ? i : rand() % (sizeof (buf) - off);
+            CPPUNIT_ASSERT_EQUAL(bpk_crc32c_slice8(buf + off, len, i),
+                    bpk_crc32c(buf + off, len, i));
+        }
+
+        crc = bpk_crc32c(buf, 1001, BPK_CRC_SEED);
+        CPPUNIT_ASSERT_EQUAL(bpk_crc32c(buf, sizeof (buf), BPK_CRC_SEED),
+                bpk_crc32c_combine(crc, bpk_crc32c(buf + 1001,
+                        sizeof (buf) - 1001, BPK_CRC_SEED),
+                    sizeof (buf) - 1001));
+    }
+
+    void xxh3()
+    {
+        static const struct {
+            size_t len;
+            uint64_t hash;
+        } vectors[] = {
+            { 0, 0x2d06800538d394c2ULL },
+            { 3, 0x15f7093b173d005cULL },
+            { 5, 0xb290cafc7b254345ULL },
+            { 12, 0x46aaf92c7550afa4ULL },
+            { 100, 0x8c97158042fbf926ULL },
+            { 200, 0x12fdb864685f344dULL },
+            { 1000, 0x989765d0ea7a5ecdULL },
+            { 4096, 0xa3c19f8174cde0bbULL },
+        };
+        unsigned char buf[SZ_1K * 4];
+        xxh3_state state;
+        size_t i, off, chunk;
+
+        for (i = 0; i < sizeof (buf); ++i)
+            buf[i] = (unsigned char) (i * 31 + 7);
+
+        CPPUNIT_ASSERT_EQUAL((uint64_t) 0x72dcb18b67a17dffULL,
+                bpk_xxh3_64("123456789", 9));
+
+        for (i = 0; i < sizeof (vectors) / sizeof (vectors[0]); ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(vectors[i].hash,
+                    bpk_xxh3_64(buf, vectors[i].len));
+
+            /* streaming with odd chunks */
+            for (chunk = 1; chunk < 600; chunk += 97)
+            {
+                bpk_xxh3_init(&state);
+                for (off = 0; off < vectors[i].len; off += chunk)
+                    bpk_xxh3_update(&state, buf + off,
+                            (vectors[i].len - off > chunk) ?
+                            chunk : vectors[i].len - off);
+                CPPUNIT_ASSERT_EQUAL(vectors[i].hash,
+                        bpk_xxh3_digest(&state));
+            }
+        }
+    }
+
+    void cksum()
+    {
+        bpk_cksum algos[] = { BPK_CKSUM_XXH3, BPK_CKSUM_CRC32C,
+            BPK_CKSUM_CRC32 };
+        bpk_type type;
+        uint32_t crc;
+        int i = 0;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_set_cksum(m_bpk, 42) != 0);
+        for (i = 0; i < 3; ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(0, bpk_set_cksum(m_bpk, algos[i]));
+            CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_BL, i, m_data));
+        }
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+
+        i = 0;
+        while ((type = bpk_next(m_bpk, NULL, &crc, NULL)) != BPK_TYPE_INVALID)
+        {
+            CPPUNIT_ASSERT_EQUAL(algos[i++], bpk_get_cksum(m_bpk));
+            CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+            CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 2));
+        }
+        CPPUNIT_ASSERT_EQUAL(3, i);
+
+        /* m_data is 2K of zeros */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_BL, 1, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL(bpk_crc32c_slice8(m_data_zero, SZ_1K * 2,
+                    BPK_CRC_SEED), crc);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_BL, 0, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL((uint32_t) bpk_xxh3_64(m_data_zero, SZ_1K * 2),
+                crc);
+
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
 };
+const char crcTest::m_data_zero[SZ_1K * 2] = { 0 };
 CPPUNIT_TEST_SUITE_REGISTRATION(crcTest);
 
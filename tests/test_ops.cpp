@@ -26,19 +26,27 @@
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <exception>
+#include <fstream>
+#include <iterator>
+#include <string>
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "bpk.h"
 #include "bpk_priv.h"
+#include "crc32.h"
 
 #define SZ_1K (1024)
 #define SZ_512 (512)
+#define SZ_4K (4096)
 
 class opsTest : public CppUnit::TestFixture
 {
@@ -48,7 +56,28 @@ class opsTest : public CppUnit::TestFixture
     CPPUNIT_TEST(find);
     CPPUNIT_TEST(crc);
     CPPUNIT_TEST(append);
+    CPPUNIT_TEST(hcrc);
+    CPPUNIT_TEST(version);
     CPPUNIT_TEST(bigfile);
+    CPPUNIT_TEST(verify);
+    CPPUNIT_TEST(mapped);
+    CPPUNIT_TEST(buffer);
+    CPPUNIT_TEST(copy);
+    CPPUNIT_TEST(index);
+    CPPUNIT_TEST(toc);
+    CPPUNIT_TEST(scan);
+    CPPUNIT_TEST(cursor);
+    CPPUNIT_TEST(align);
+    CPPUNIT_TEST(direct);
+    CPPUNIT_TEST(sparse);
+    CPPUNIT_TEST(edit);
+    CPPUNIT_TEST(large);
+    CPPUNIT_TEST(prealloc);
+    CPPUNIT_TEST(stream);
+    CPPUNIT_TEST(reader);
+    CPPUNIT_TEST(io);
+    CPPUNIT_TEST(drain);
+    CPPUNIT_TEST(lend);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -208,6 +237,124 @@ protected:
         m_bpk = NULL;
     }
 
+    void check_file_crc()
+    {
+        uint32_t file_crc = 0;
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(bpk_compute_crc(m_bpk, &file_crc), file_crc);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void hcrc()
+    {
+        /* the running crc covers the headers written so far */
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->flags & FLAG_HCRC);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_BL, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * sizeof (bpk_part), m_bpk->hlen);
+        bpk_close(m_bpk);
+        check_file_crc();
+
+        /* seeded from the existing headers when appending */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->flags & FLAG_HCRC);
+        CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * sizeof (bpk_part), m_bpk->hlen);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        bpk_close(m_bpk);
+        check_file_crc();
+
+        /* the headers are walked again when it can't be trusted */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_FWV, 0, m_data));
+        m_bpk->flags &= ~FLAG_HCRC;
+        bpk_close(m_bpk);
+        check_file_crc();
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 4, bpk_count(m_bpk));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    uint32_t header_version()
+    {
+        bpk_header hdr;
+        int fd = open(m_file, O_RDONLY);
+
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (hdr),
+                pread(fd, &hdr, sizeof (hdr), 0));
+        close(fd);
+        return be32toh(hdr.version);
+    }
+
+    void version()
+    {
+        /* packages without newer features stay readable by 1.0 readers */
+        create();
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_1_0, header_version());
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_1_0, header_version());
+
+        /* appending newer features raises the version */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_cksum(m_bpk, BPK_CKSUM_XXH3));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_FWV, 1, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_CKSUM, header_version());
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_toc(m_bpk, 1));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_TOC, header_version());
+
+        /* but never lowers it */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_DEZC, 0, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_TOC, header_version());
+
+        /* 1.x readers must reject sparse partitions */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_sparse(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) BPK_VERSION_SPARSE, header_version());
+        CPPUNIT_ASSERT(BPK_MAJOR(header_version()) > BPK_MAJOR(BPK_VERSION_1_0));
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
     void bigfile()
     {
         create();
@@ -231,6 +378,1484 @@ protected:
         bpk_close(m_bpk);
         m_bpk = NULL;
     }
+
+    void verify()
+    {
+        bpk_verify_result *res = NULL;
+        size_t count = 0;
+
+        create();
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, &res, &count));
+        CPPUNIT_ASSERT_EQUAL((size_t) 5, count); /* must match create() */
+        CPPUNIT_ASSERT(res);
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BLV, res[1].type);
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0xFFFFFFFF, res[1].hw_id);
+        for (size_t i = 0; i < count; ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(BPK_VERIFY_OK, res[i].status);
+            CPPUNIT_ASSERT_EQUAL(res[i].crc, res[i].computed);
+            CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K * 2, res[i].size);
+        }
+        free(res);
+        res = NULL;
+
+        /* read pointer is back on the first partition */
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BL,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        bpk_close(m_bpk);
+
+        /* corrupt third partition data */
+        FILE *fd = fopen(m_file, "r+");
+        CPPUNIT_ASSERT(fd);
+        fseek(fd, sizeof (bpk_header) + 3 * sizeof (bpk_part) +
+                2 * SZ_1K * 2 + 42, SEEK_SET);
+        fwrite("test", 4, 1, fd);
+        fclose(fd);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(-2, bpk_verify_all(m_bpk, &res, &count));
+        CPPUNIT_ASSERT_EQUAL((size_t) 5, count);
+        CPPUNIT_ASSERT_EQUAL(BPK_VERIFY_OK, res[1].status);
+        CPPUNIT_ASSERT_EQUAL(BPK_VERIFY_CRC, res[2].status);
+        free(res);
+        bpk_close(m_bpk);
+
+        /* corrupt a part header */
+        fd = fopen(m_file, "r+");
+        CPPUNIT_ASSERT(fd);
+        fseek(fd, sizeof (bpk_header) + offsetof (bpk_part, hw_id), SEEK_SET);
+        fwrite("test", 4, 1, fd);
+        fclose(fd);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(-1, bpk_verify_all(m_bpk, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void mapped()
+    {
+        bpk_size size;
+        uint32_t hw_id = 1;
+        uint32_t crc;
+        char buf[SZ_1K];
+
+        create();
+
+        CPPUNIT_ASSERT(bpk_open_flags(m_file,
+                    BPK_OPEN_MMAP | BPK_OPEN_APPEND) == NULL);
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+        m_bpk = bpk_open_flags(m_file, BPK_OPEN_MMAP);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, &size, &crc));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K * 2, size);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 2));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+
+        struct stat st;
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_data, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) SZ_1K * 2, st.st_size);
+
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_RFS,
+                bpk_next(m_bpk, &size, NULL, &hw_id));
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0, hw_id);
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K,
+                bpk_read(m_bpk, buf, SZ_1K));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K,
+                bpk_read(m_bpk, buf, SZ_1K));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 0,
+                bpk_read(m_bpk, buf, SZ_1K));
+
+        CPPUNIT_ASSERT_EQUAL((bpk_type) 42,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void buffer()
+    {
+        uint32_t crc;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_set_buffer_size(m_bpk, 0) != 0);
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+
+        /* odd size, not a divisor of the part size */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, 100));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_BL, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, SZ_1K * 4));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, 100));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+
+        struct stat st;
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_data, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) SZ_1K * 2, st.st_size);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void copy()
+    {
+        const size_t size = BPK_COPY_CHUNK + 1234;
+        unsigned char *buf = (unsigned char *) malloc(size);
+        uint32_t crc;
+
+        CPPUNIT_ASSERT(buf);
+        for (size_t i = 0; i < size; ++i)
+            buf[i] = i * 7 + (i >> 12);
+
+        FILE *fd = fopen(m_data, "w");
+        CPPUNIT_ASSERT(fd);
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, fwrite(buf, size, 1, fd));
+        fclose(fd);
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL(bpk_crc32(buf, size, BPK_CRC_SEED), crc);
+
+        /* extraction, starting in the middle of the partition */
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 42, bpk_read(m_bpk, buf, 42));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+
+        unsigned char *out = (unsigned char *) malloc(size);
+        CPPUNIT_ASSERT(out);
+        fd = fopen(m_data, "r");
+        CPPUNIT_ASSERT(fd);
+        CPPUNIT_ASSERT_EQUAL((size_t) size - 42, fread(out, 1, size, fd));
+        fclose(fd);
+        CPPUNIT_ASSERT(memcmp(buf + 42, out, size - 42) == 0);
+        free(out);
+        free(buf);
+    }
+
+    void index()
+    {
+        bpk_size size;
+        uint32_t hw_id = 0;
+        uint32_t crc;
+
+        create();
+
+        m_bpk = bpk_open_flags(m_file, BPK_OPEN_INDEX);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 5, bpk_count(m_bpk));
+
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, &size, &crc));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K * 2, size);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_RFS,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        CPPUNIT_ASSERT(bpk_find(m_bpk, BPK_TYPE_BLV, 0, NULL, NULL) != 0);
+
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BLV,
+                bpk_part_at(m_bpk, 1, NULL, NULL, &hw_id));
+        CPPUNIT_ASSERT_EQUAL((uint32_t) 0xFFFFFFFF, hw_id);
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_KER,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_part_at(m_bpk, 5, NULL, NULL, NULL));
+        bpk_close(m_bpk);
+
+        /* many hw_ids and a duplicate, appended with an index */
+        m_bpk = bpk_open_flags(m_file, BPK_OPEN_APPEND | BPK_OPEN_INDEX);
+        CPPUNIT_ASSERT(m_bpk);
+        for (uint32_t i = 1; i <= 200; ++i)
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_write(m_bpk, BPK_TYPE_KER, i, m_data));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_BL, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 206, bpk_count(m_bpk));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 206, bpk_count(m_bpk));
+        for (uint32_t i = 200; i > 0; --i)
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, BPK_TYPE_KER, i, NULL, NULL));
+        /* first match wins, as when walking the file */
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_BL, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BLV,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void toc()
+    {
+        bpk_verify_result *res = NULL;
+        size_t count = 0;
+        struct stat st;
+        off_t toc;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_toc(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_BL, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 1, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_set_toc(m_bpk, 1) != 0);
+        CPPUNIT_ASSERT(m_bpk->toc != 0);
+        CPPUNIT_ASSERT(m_bpk->index != NULL); /* loaded from the toc */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 2, bpk_count(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 1, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+
+        /* the toc is verified, but hidden like in bpk_count */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, &res, &count));
+        CPPUNIT_ASSERT_EQUAL((size_t) 2, count);
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_KER, res[1].type);
+        free(res);
+        bpk_close(m_bpk);
+
+        /* the toc is kept up to date when appending */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT(m_bpk->index != NULL);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 3, bpk_count(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_RFS,
+                bpk_part_at(m_bpk, 2, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT_EQUAL(m_bpk->size, st.st_size);
+        toc = m_bpk->toc;
+        bpk_close(m_bpk);
+
+        /* toc entries pointing past the toc are rejected */
+        bpk_part part, saved_part;
+        bpk_toc_entry entries[3], saved[3];
+        int tfd = open(m_file, O_RDWR);
+        CPPUNIT_ASSERT(tfd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (part),
+                pread(tfd, &part, sizeof (part), toc));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (entries),
+                pread(tfd, entries, sizeof (entries), toc + sizeof (part)));
+        saved_part = part;
+        memcpy(saved, entries, sizeof (saved));
+        entries[1].offset = htobe64(toc + sizeof (part) + SZ_4K);
+        part.crc = htobe32(bpk_crc32(entries, sizeof (entries), BPK_CRC_SEED));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (entries),
+                pwrite(tfd, entries, sizeof (entries), toc + sizeof (part)));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (part),
+                pwrite(tfd, &part, sizeof (part), toc));
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->index == NULL);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 3, bpk_count(m_bpk));
+        bpk_close(m_bpk);
+
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (saved),
+                pwrite(tfd, saved, sizeof (saved), toc + sizeof (part)));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) sizeof (saved_part),
+                pwrite(tfd, &saved_part, sizeof (saved_part), toc));
+        close(tfd);
+
+        /* a corrupted toc is ignored */
+        FILE *fd = fopen(m_file, "r+");
+        CPPUNIT_ASSERT(fd);
+        fseek(fd, toc + sizeof (bpk_part) + 4, SEEK_SET);
+        fwrite("test", 4, 1, fd);
+        fclose(fd);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->index == NULL);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 3, bpk_count(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(-2, bpk_verify_all(m_bpk, &res, &count));
+        CPPUNIT_ASSERT_EQUAL((size_t) 3, count);
+        free(res);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    static ssize_t fill_small(void *buf, size_t size, void *arg)
+    {
+        size_t *left = (size_t *) arg;
+
+        if (size > *left)
+            size = *left;
+        memset(buf, 'a', size);
+        *left -= size;
+        return size;
+    }
+
+    void scan()
+    {
+        const uint32_t parts = 3000; /* more than a scan window */
+        uint32_t hw_id;
+        char buf[150];
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        for (uint32_t i = 0; i < parts; ++i)
+        {
+            size_t left = i % 150;
+            CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_FWV, i,
+                        fill_small, &left));
+        }
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        for (uint32_t i = 0; i < parts; ++i)
+        {
+            bpk_size size;
+
+            CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_FWV,
+                    bpk_next(m_bpk, &size, NULL, &hw_id));
+            CPPUNIT_ASSERT_EQUAL(i, hw_id);
+            CPPUNIT_ASSERT_EQUAL((bpk_size) i % 150, size);
+            if (i % 100 == 99)
+            {
+                CPPUNIT_ASSERT_EQUAL(size, bpk_read(m_bpk, buf, size));
+                CPPUNIT_ASSERT_EQUAL('a', buf[size - 1]);
+            }
+        }
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) parts, bpk_count(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_FWV, parts - 1, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    struct cursor_job
+    {
+        bpk *file;
+        bpk_type type;
+        uint32_t hw_id;
+        int ok;
+    };
+
+    static void *cursor_worker(void *arg)
+    {
+        cursor_job *job = (cursor_job *) arg;
+        bpk_cursor *cur = bpk_cursor_new(job->file);
+        unsigned char buf[100];
+        bpk_size size, len;
+        uint32_t crc, computed = 0;
+
+        job->ok = 0;
+        if (cur == NULL)
+            return NULL;
+
+        for (int i = 0; i < 50; ++i)
+        {
+            if (bpk_cursor_find(cur, job->type, job->hw_id, &size, &crc) != 0)
+                break;
+
+            computed = 0;
+            while ((len = bpk_cursor_read(cur, buf, sizeof (buf))) != 0)
+            {
+                computed = bpk_crc32(buf, len, computed);
+                size -= len;
+            }
+            if (size != 0 || computed != crc ||
+                    bpk_cursor_compute_data_crc(cur) != crc)
+                break;
+        }
+        job->ok = (computed == crc);
+        bpk_cursor_free(cur);
+        return NULL;
+    }
+
+    void cursor()
+    {
+        const bpk_type types[] = {
+            BPK_TYPE_BL, BPK_TYPE_BLV, BPK_TYPE_KER, BPK_TYPE_RFS
+        };
+        cursor_job jobs[4];
+        pthread_t tids[4];
+        bpk_size size;
+        uint32_t crc;
+
+        create();
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_cursor_new(m_bpk) == NULL);
+        CPPUNIT_ASSERT_EQUAL(EBADF, errno);
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+
+        /* cursors are independent from the bpk read pointer */
+        bpk_cursor *cur = bpk_cursor_new(m_bpk);
+        CPPUNIT_ASSERT(cur);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BL,
+                bpk_cursor_next(cur, &size, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_RFS,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_BLV,
+                bpk_cursor_next(cur, NULL, NULL, NULL));
+        CPPUNIT_ASSERT(bpk_cursor_find(cur, BPK_TYPE_BLV, 0, NULL, NULL) != 0);
+
+        /* the cursor buffer outlives the bpk buffer size changes */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, SZ_512));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_cursor_find(cur, BPK_TYPE_BL, 0, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_cursor_compute_data_crc(cur));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_cursor_compute_data_crc(cur));
+        bpk_cursor_free(cur);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            jobs[i].file = m_bpk;
+            jobs[i].type = types[i];
+            jobs[i].hw_id = (types[i] == BPK_TYPE_BLV) ? 0xFFFFFFFF : 0;
+            CPPUNIT_ASSERT_EQUAL(0,
+                    pthread_create(&tids[i], NULL, cursor_worker, &jobs[i]));
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            pthread_join(tids[i], NULL);
+            CPPUNIT_ASSERT_EQUAL(1, jobs[i].ok);
+        }
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void align()
+    {
+        size_t left;
+        uint32_t crc;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_set_align(m_bpk, 3000) != 0);
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        left = 42;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_FWV, 0,
+                    fill_small, &left));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        /* next padding partition has no data */
+        left = SZ_4K - 2 * sizeof (bpk_part);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_DEZC, 0,
+                    fill_small, &left));
+        left = 42;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_FWV, 1,
+                    fill_small, &left));
+        bpk_close(m_bpk);
+
+        /* unaligned parts can be appended */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_BL, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 6, bpk_count(m_bpk));
+
+        const bpk_type types[] = {
+            BPK_TYPE_FWV, BPK_TYPE_KER, BPK_TYPE_DEZC, BPK_TYPE_FWV,
+            BPK_TYPE_RFS, BPK_TYPE_BL
+        };
+        bpk_rewind(m_bpk);
+        for (int i = 0; i < 6; ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(types[i],
+                    bpk_next(m_bpk, NULL, &crc, NULL));
+            CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+            if (types[i] != BPK_TYPE_RFS)
+                CPPUNIT_ASSERT_EQUAL((off_t) 0, m_bpk->poff % SZ_4K);
+            else
+                CPPUNIT_ASSERT(m_bpk->poff % SZ_4K != 0);
+        }
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+    void direct()
+    {
+        const size_t size = 5 * 2 * SZ_4K + 1234;
+        unsigned char *buf = (unsigned char *) malloc(size);
+        unsigned char *out = (unsigned char *) malloc(size);
+        off_t off;
+
+        CPPUNIT_ASSERT(buf && out);
+        for (size_t i = 0; i < size; ++i)
+            buf[i] = i * 13 + (i >> 10);
+
+        FILE *fd = fopen(m_data, "w");
+        CPPUNIT_ASSERT(fd);
+        CPPUNIT_ASSERT_EQUAL((size_t) 1, fwrite(buf, size, 1, fd));
+        fclose(fd);
+
+        /* an unaligned partition, then an aligned one */
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        const bpk_type types[] = { BPK_TYPE_RFS, BPK_TYPE_KER };
+        for (int i = 0; i < 2; ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, types[i], 0, NULL, NULL));
+            CPPUNIT_ASSERT(bpk_read_file_direct(m_bpk, m_data, 1000) != 0);
+            CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_read_file_direct(m_bpk, m_data, 2 * SZ_4K));
+
+            memset(out, 0, size);
+            fd = fopen(m_data, "r");
+            CPPUNIT_ASSERT(fd);
+            CPPUNIT_ASSERT_EQUAL(size, fread(out, 1, size + 1, fd));
+            fclose(fd);
+            CPPUNIT_ASSERT(memcmp(buf, out, size) == 0);
+        }
+
+        /* extraction starting in the middle of the partition */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+        off = m_bpk->poff;
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 42, bpk_read(m_bpk, out, 42));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file_direct(m_bpk, m_data, 0));
+        fd = fopen(m_data, "r");
+        CPPUNIT_ASSERT(fd);
+        CPPUNIT_ASSERT_EQUAL(size - 42, fread(out, 1, size, fd));
+        fclose(fd);
+        CPPUNIT_ASSERT(memcmp(buf + 42, out, size - 42) == 0);
+        bpk_close(m_bpk);
+
+        /* corrupted data is detected */
+        int fdw = open(m_file, O_WRONLY);
+        CPPUNIT_ASSERT(fdw >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 1, pwrite(fdw, "X", 1, off + 4242));
+        close(fdw);
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(-5, bpk_read_file_direct(m_bpk, m_data, 0));
+        CPPUNIT_ASSERT_EQUAL(EBADMSG, errno);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+        free(out);
+        free(buf);
+    }
+    static unsigned char sparse_byte(size_t pos)
+    {
+        return ((pos / SZ_4K) % 3 == 0) ? (pos & 0xFF) | 1 : 0;
+    }
+
+    static ssize_t fill_sparse(void *buf, size_t size, void *arg)
+    {
+        size_t *pos = (size_t *) arg;
+        const size_t end = 100 * SZ_4K + 42;
+
+        /* short and unaligned chunks */
+        size = (size > 10000) ? 10000 : size;
+        if (size > end - *pos)
+            size = end - *pos;
+        for (size_t i = 0; i < size; ++i)
+            ((unsigned char *) buf)[i] = sparse_byte(*pos + i);
+        *pos += size;
+        return size;
+    }
+
+    void sparse()
+    {
+        const size_t size = 1024 * SZ_1K;
+        const size_t stream_size = 100 * SZ_4K + 42;
+        unsigned char *buf = (unsigned char *) calloc(1, size);
+        unsigned char *out = (unsigned char *) malloc(size);
+        size_t pos = 0;
+        bpk_size psize;
+        uint32_t crc;
+        struct stat st;
+
+        CPPUNIT_ASSERT(buf && out);
+        for (size_t i = 0; i < SZ_4K; ++i)
+            buf[i] = i | 1;
+        for (size_t i = 512 * SZ_1K; i < 512 * SZ_1K + 10000; ++i)
+            buf[i] = i | 1;
+
+        /* a sparse file with a trailing hole */
+        int fd = open(m_data, O_WRONLY | O_TRUNC);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) SZ_4K, pwrite(fd, buf, SZ_4K, 0));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 10000,
+                pwrite(fd, buf + 512 * SZ_1K, 10000, 512 * SZ_1K));
+        CPPUNIT_ASSERT_EQUAL(0, ftruncate(fd, size));
+        close(fd);
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_sparse(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_KER, 0,
+                    fill_sparse, &pos));
+        bpk_close(m_bpk);
+
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT(st.st_size < (off_t) (size / 4));
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+
+        /* size and checksum cover the logical content */
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_RFS, 0, &psize, &crc));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) size, psize);
+        CPPUNIT_ASSERT_EQUAL(bpk_crc32(buf, size, BPK_CRC_SEED), crc);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc_mt(m_bpk, 4));
+
+        CPPUNIT_ASSERT_EQUAL((bpk_size) size, bpk_read(m_bpk, out, size));
+        CPPUNIT_ASSERT(memcmp(buf, out, size) == 0);
+
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_data, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) size, st.st_size);
+        CPPUNIT_ASSERT(st.st_blocks * 512 < (blkcnt_t) (size / 4));
+        fd = open(m_data, O_RDONLY);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) size, ::read(fd, out, size));
+        close(fd);
+        CPPUNIT_ASSERT(memcmp(buf, out, size) == 0);
+
+        /* streamed data */
+        for (size_t i = 0; i < stream_size; ++i)
+            buf[i] = sparse_byte(i);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, &psize, &crc));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) stream_size, psize);
+        CPPUNIT_ASSERT_EQUAL(bpk_crc32(buf, stream_size, BPK_CRC_SEED), crc);
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 42, bpk_read(m_bpk, out, 42));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+        fd = open(m_data, O_RDONLY);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) stream_size - 42,
+                ::read(fd, out, size));
+        close(fd);
+        CPPUNIT_ASSERT(memcmp(buf + 42, out, stream_size - 42) == 0);
+
+        /* cursors, reading across a hole */
+        bpk_cursor *cur = bpk_cursor_new(m_bpk);
+        CPPUNIT_ASSERT(cur);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_cursor_find(cur, BPK_TYPE_KER, 0, NULL, &crc));
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_cursor_compute_data_crc(cur));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_cursor_seek(cur, SZ_4K - 10));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 3 * SZ_4K,
+                bpk_cursor_read(cur, out, 3 * SZ_4K));
+        CPPUNIT_ASSERT(memcmp(buf + SZ_4K - 10, out, 3 * SZ_4K) == 0);
+        CPPUNIT_ASSERT(bpk_cursor_seek(cur, stream_size + 1) != 0);
+        bpk_cursor_free(cur);
+        bpk_close(m_bpk);
+
+        /* damaged extent table trailer, on the last partition */
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        corrupt(m_file, st.st_size - 1);
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(-1,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        cur = bpk_cursor_new(m_bpk);
+        CPPUNIT_ASSERT(cur);
+        CPPUNIT_ASSERT_EQUAL(-1,
+                bpk_cursor_find(cur, BPK_TYPE_KER, 0, &psize, &crc));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 0, bpk_cursor_read(cur, out, 42));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_cursor_find(cur, BPK_TYPE_RFS, 0, &psize, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) size, psize);
+        bpk_cursor_free(cur);
+
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+        free(out);
+        free(buf);
+    }
+
+    static void write_data(const char *file, char c, size_t size)
+    {
+        char buf[SZ_4K];
+        int fd = open(file, O_WRONLY | O_TRUNC);
+
+        CPPUNIT_ASSERT(fd >= 0 && size <= sizeof (buf));
+        memset(buf, c, size);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) size, write(fd, buf, size));
+        close(fd);
+    }
+
+    void check_data(bpk_type type, char c, size_t size)
+    {
+        char buf[SZ_4K];
+        bpk_size psize;
+
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, type, 0, &psize, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) size, psize);
+        CPPUNIT_ASSERT_EQUAL(psize, bpk_read(m_bpk, buf, sizeof (buf)));
+        for (size_t i = 0; i < size; ++i)
+            CPPUNIT_ASSERT_EQUAL(c, buf[i]);
+    }
+
+    void edit()
+    {
+        struct stat st;
+        off_t size;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_toc(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        write_data(m_data, 'a', 3000);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_FWV, 0, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        size = st.st_size;
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        /* same size and smaller: rewritten in place */
+        write_data(m_data, 'b', 3000);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_replace(m_bpk, BPK_TYPE_KER, 0, m_data));
+        write_data(m_data, 'c', 1000);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_replace(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT_EQUAL(size, st.st_size);
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        /* bigger: appended */
+        write_data(m_data, 'd', 3500);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_replace(m_bpk, BPK_TYPE_FWV, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_remove(m_bpk, BPK_TYPE_RFS, 0));
+        CPPUNIT_ASSERT_EQUAL(-1, bpk_remove(m_bpk, BPK_TYPE_RFS, 0));
+        CPPUNIT_ASSERT_EQUAL(ENOENT, errno);
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(-2, bpk_remove(m_bpk, BPK_TYPE_KER, 0));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 2, bpk_count(m_bpk));
+        check_data(BPK_TYPE_KER, 'b', 3000);
+        check_data(BPK_TYPE_FWV, 'd', 3500);
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_compact(m_bpk));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT(st.st_size < size);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->toc != 0);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 2, bpk_count(m_bpk));
+        check_data(BPK_TYPE_KER, 'b', 3000);
+        CPPUNIT_ASSERT_EQUAL((off_t) 0, m_bpk->poff % SZ_4K);
+        check_data(BPK_TYPE_FWV, 'd', 3500);
+        CPPUNIT_ASSERT_EQUAL((off_t) 0, m_bpk->poff % SZ_4K);
+        bpk_close(m_bpk);
+
+        /* the alignment is kept with the default settings */
+        m_bpk = bpk_open(m_file, 1);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_remove(m_bpk, BPK_TYPE_KER, 0));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_compact(m_bpk));
+        bpk_close(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT(st.st_size < 3 * SZ_4K);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 1, bpk_count(m_bpk));
+        check_data(BPK_TYPE_FWV, 'd', 3500);
+        CPPUNIT_ASSERT_EQUAL((off_t) 0, m_bpk->poff % SZ_4K);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void large()
+    {
+        const off_t size = 5LL * 1024 * 1024 * 1024;
+        const off_t tail = 4LL * 1024 * 1024 * 1024 + 42;
+        const size_t align = (size_t) 1 << 31;
+        char buf[SZ_4K], out[SZ_4K];
+        bpk_size psize;
+        uint32_t crc;
+        struct stat st;
+        size_t left;
+
+        /* a sparse file crossing the 4GiB boundary */
+        memset(buf, 'b', sizeof (buf));
+        int fd = open(m_data, O_WRONLY | O_TRUNC);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) SZ_4K, pwrite(fd, buf, SZ_4K, 0));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) SZ_4K, pwrite(fd, buf, SZ_4K, tail));
+        CPPUNIT_ASSERT_EQUAL(0, ftruncate(fd, size));
+        close(fd);
+
+        /* padding holes push the parts beyond 4GiB */
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_toc(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_sparse(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, align));
+        left = 42;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_FWV, 0,
+                    fill_small, &left));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        left = 42;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_KER, 0,
+                    fill_small, &left));
+        bpk_close(m_bpk);
+
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT(st.st_size > 3 * (off_t) align);
+        CPPUNIT_ASSERT(st.st_blocks * 512 < 1024 * SZ_1K);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->toc > 3 * (off_t) align);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_FWV,
+                bpk_next(m_bpk, &psize, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((off_t) align, m_bpk->poff);
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_RFS,
+                bpk_next(m_bpk, &psize, &crc, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) size, psize);
+        CPPUNIT_ASSERT_EQUAL((off_t) 2 * (off_t) align, m_bpk->poff);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_KER,
+                bpk_next(m_bpk, &psize, &crc, NULL));
+        CPPUNIT_ASSERT_EQUAL((off_t) 3 * (off_t) align, m_bpk->poff);
+        CPPUNIT_ASSERT_EQUAL(crc, bpk_compute_data_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL((bpk_type) BPK_TYPE_INVALID,
+                bpk_next(m_bpk, NULL, NULL, NULL));
+
+        /* extraction */
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_KER, 0, &psize, &crc));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_data, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) 42, st.st_size);
+
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_file(m_bpk, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_data, &st));
+        CPPUNIT_ASSERT_EQUAL(size, st.st_size);
+        fd = open(m_data, O_RDONLY);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) SZ_4K, pread(fd, out, SZ_4K, tail));
+        close(fd);
+        CPPUNIT_ASSERT(memcmp(buf, out, SZ_4K) == 0);
+
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    void prealloc()
+    {
+        const off_t size = 1024 * SZ_1K;
+        struct stat st;
+        bpk_size psize;
+        size_t left;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_prealloc(m_bpk, size, 2));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) sizeof (bpk_header), st.st_size);
+        CPPUNIT_ASSERT(st.st_blocks * 512 >= size);
+
+        left = 42;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_sized(m_bpk, BPK_TYPE_FWV, 0, 42,
+                    fill_small, &left));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        bpk_close(m_bpk);
+
+        /* unused space is released */
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT_EQUAL((off_t) (sizeof (bpk_header) +
+                    2 * sizeof (bpk_part) + 42 + SZ_1K * 2), st.st_size);
+        CPPUNIT_ASSERT(st.st_blocks * 512 < size / 2);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_FWV, 0, &psize, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 42, psize);
+        bpk_close(m_bpk);
+
+        /* the data must match the announced size */
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        left = 10;
+        CPPUNIT_ASSERT_EQUAL(-4, bpk_write_sized(m_bpk, BPK_TYPE_FWV, 0,
+                    42, fill_small, &left));
+        CPPUNIT_ASSERT_EQUAL(EIO, errno);
+        bpk_close(m_bpk);
+
+        /* headers and padding are reserved too */
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K * 4));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_prealloc(m_bpk, SZ_4K, 2));
+        CPPUNIT_ASSERT_EQUAL(0, stat(m_file, &st));
+        CPPUNIT_ASSERT(st.st_blocks * 512 >= 9 * SZ_4K);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    struct pipe_job {
+        int in;
+        int out;
+    };
+
+    static void *pipe_worker(void *arg)
+    {
+        pipe_job *job = (pipe_job *) arg;
+        char buf[SZ_4K];
+        ssize_t len;
+
+        while ((len = ::read(job->in, buf, sizeof (buf))) > 0)
+        {
+            if (write(job->out, buf, len) != len)
+                break;
+        }
+        return NULL;
+    }
+
+    void write_stream_parts()
+    {
+        size_t left = 42;
+
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_toc(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_align(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_FWV, 0,
+                    fill_small, &left));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_cksum(m_bpk, BPK_CKSUM_XXH3));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+    }
+
+    void stream()
+    {
+        std::string ref = std::string(m_file) + ".ref";
+        pthread_t tid;
+        pipe_job job;
+        int fds[2];
+
+        m_bpk = bpk_create(ref.c_str());
+        CPPUNIT_ASSERT(m_bpk);
+        write_stream_parts();
+        bpk_close(m_bpk);
+
+        /* same package, written to a pipe */
+        CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+        job.in = fds[0];
+        job.out = open(m_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CPPUNIT_ASSERT(job.out >= 0);
+        CPPUNIT_ASSERT_EQUAL(0, pthread_create(&tid, NULL, pipe_worker, &job));
+
+        m_bpk = bpk_create_stream(fds[1]);
+        close(fds[1]);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(bpk_set_sparse(m_bpk, 1) != 0);
+        write_stream_parts();
+        CPPUNIT_ASSERT_EQUAL(0, bpk_stream_end(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(-2, bpk_stream_end(m_bpk));
+        /* the package is written, more parts would be lost */
+        CPPUNIT_ASSERT(bpk_write(m_bpk, BPK_TYPE_FWV, 0, m_file) < 0);
+        CPPUNIT_ASSERT_EQUAL(EBADF, errno);
+        CPPUNIT_ASSERT(bpk_write_sized(m_bpk, BPK_TYPE_FWV, 0, 0,
+                    NULL, NULL) < 0);
+        CPPUNIT_ASSERT_EQUAL(EBADF, errno);
+        bpk_close(m_bpk);
+
+        pthread_join(tid, NULL);
+        close(job.in);
+        close(job.out);
+
+        std::ifstream a(ref.c_str()), b(m_file);
+        std::string ref_data((std::istreambuf_iterator<char>(a)),
+                std::istreambuf_iterator<char>());
+        std::string data((std::istreambuf_iterator<char>(b)),
+                std::istreambuf_iterator<char>());
+        unlink(ref.c_str());
+        CPPUNIT_ASSERT(ref_data == data);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->toc != 0);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 2, bpk_count(m_bpk));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    static void corrupt(const char *file, off_t off)
+    {
+        int fd = open(file, O_RDWR);
+        char c;
+
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 1, pread(fd, &c, 1, off));
+        c ^= 0x01;
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 1, pwrite(fd, &c, 1, off));
+        close(fd);
+    }
+
+    void reader()
+    {
+        bpk_reader *rd;
+        bpk_type type;
+        bpk_size size;
+        bpk_size ker;
+        pthread_t tid;
+        pipe_job job;
+        char buf[10];
+        std::string data;
+        ssize_t len;
+        int fds[2];
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        write_stream_parts();
+        bpk_close(m_bpk);
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        ker = m_bpk->poff;
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+
+        /* not a package */
+        job.in = open(m_data, O_RDONLY);
+        CPPUNIT_ASSERT(bpk_reader_new(job.in) == NULL);
+        CPPUNIT_ASSERT_EQUAL(EILSEQ, errno);
+        close(job.in);
+
+        /* pipe the package, alignment and toc parts are skipped */
+        CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+        job.in = open(m_file, O_RDONLY);
+        job.out = fds[1];
+        CPPUNIT_ASSERT(job.in >= 0);
+        CPPUNIT_ASSERT_EQUAL(0, pthread_create(&tid, NULL, pipe_worker, &job));
+        rd = bpk_reader_new(fds[0]);
+        CPPUNIT_ASSERT(rd);
+
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, &size, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(BPK_TYPE_FWV, type);
+        CPPUNIT_ASSERT_EQUAL((bpk_size) 42, size);
+        while ((len = bpk_reader_read(rd, buf, sizeof (buf))) > 0)
+            data.append(buf, len);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 0, len);
+        CPPUNIT_ASSERT(data == std::string(42, 'a'));
+
+        /* skipped without being read */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, &size, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(BPK_TYPE_KER, type);
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K * 2, size);
+        CPPUNIT_ASSERT_EQUAL(1, bpk_reader_next(rd, &type, &size, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(1, bpk_reader_next(rd, &type, &size, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 0, bpk_reader_read(rd, buf, sizeof (buf)));
+        bpk_reader_free(rd);
+        pthread_join(tid, NULL);
+        close(job.in);
+        close(fds[0]);
+        close(fds[1]);
+
+        /* corrupted data */
+        corrupt(m_file, ker + 10);
+        job.in = open(m_file, O_RDONLY);
+        rd = bpk_reader_new(job.in);
+        CPPUNIT_ASSERT(rd);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(BPK_TYPE_KER, type);
+        while ((len = bpk_reader_read(rd, buf, sizeof (buf))) > 0)
+            ;
+        CPPUNIT_ASSERT_EQUAL((ssize_t) -1, len);
+        CPPUNIT_ASSERT_EQUAL(EBADMSG, errno);
+        CPPUNIT_ASSERT_EQUAL(1, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        bpk_reader_free(rd);
+        close(job.in);
+
+        /* corrupted partition header */
+        corrupt(m_file, ker - 8);
+        job.in = open(m_file, O_RDONLY);
+        rd = bpk_reader_new(job.in);
+        CPPUNIT_ASSERT(rd);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(-1, bpk_reader_next(rd, &type, NULL, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(EBADMSG, errno);
+        bpk_reader_free(rd);
+        close(job.in);
+    }
+
+    void io()
+    {
+        bpk_mem *mem;
+        const void *data;
+        size_t size;
+        bpk_size psize;
+        char buf[42];
+        int fd;
+
+        /* built in memory */
+        mem = bpk_mem_new(NULL, 0);
+        CPPUNIT_ASSERT(mem);
+        m_bpk = bpk_open_ops(&bpk_io_mem, mem, BPK_OPEN_APPEND);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->fd < 0);
+        write_stream_parts();
+        CPPUNIT_ASSERT(bpk_set_prealloc(m_bpk, SZ_4K, 1) != 0);
+        CPPUNIT_ASSERT_EQUAL(EOPNOTSUPP, errno);
+        bpk_close(m_bpk);
+
+        data = bpk_mem_data(mem, &size);
+        fd = open(m_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CPPUNIT_ASSERT(fd >= 0);
+        CPPUNIT_ASSERT_EQUAL((ssize_t) size, write(fd, data, size));
+        close(fd);
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->toc != 0);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        bpk_close(m_bpk);
+
+        /* edited in memory */
+        m_bpk = bpk_open_ops(&bpk_io_mem, mem, BPK_OPEN_APPEND);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_remove(m_bpk, BPK_TYPE_FWV, 0));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_compact(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_RFS, 0, m_data));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open_ops(&bpk_io_mem, mem, BPK_OPEN_INDEX);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 2, bpk_count(m_bpk));
+        CPPUNIT_ASSERT(bpk_find(m_bpk, BPK_TYPE_FWV, 0, NULL, NULL) != 0);
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_find(m_bpk, BPK_TYPE_RFS, 0, &psize, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) SZ_1K * 2, psize);
+        CPPUNIT_ASSERT_EQUAL((bpk_size) sizeof (buf),
+                bpk_read(m_bpk, buf, sizeof (buf)));
+        CPPUNIT_ASSERT(std::string(buf, sizeof (buf)) ==
+                std::string(sizeof (buf), '\0'));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+        bpk_mem_free(mem);
+
+        /* not a package */
+        mem = bpk_mem_new("garbage", 7);
+        CPPUNIT_ASSERT(bpk_open_ops(&bpk_io_mem, mem, 0) == NULL);
+        CPPUNIT_ASSERT_EQUAL(EILSEQ, errno);
+        bpk_mem_free(mem);
+
+        /* file descriptors are left open */
+        fd = open(m_file, O_RDONLY);
+        CPPUNIT_ASSERT(fd >= 0);
+        m_bpk = bpk_open_ops(&bpk_io_fd, &fd, BPK_OPEN_MMAP);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT(m_bpk->map != NULL);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+        CPPUNIT_ASSERT_EQUAL((off_t) 0, lseek(fd, 0, SEEK_SET));
+        close(fd);
+    }
+
+    static int drain_string(const void *buf, size_t count, void *arg)
+    {
+        ((std::string *) arg)->append((const char *) buf, count);
+        return 0;
+    }
+
+    static int drain_fail(const void *, size_t, void *)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    static int drain_count(const void *, size_t count, void *arg)
+    {
+        *(size_t *) arg += count;
+        return 1;
+    }
+
+    void drain()
+    {
+        const int flags[] = { 0, BPK_OPEN_MMAP };
+        size_t pos = 0;
+        std::string data;
+        bpk_size ker;
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_cksum(m_bpk, BPK_CKSUM_XXH3));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write(m_bpk, BPK_TYPE_KER, 0, m_data));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_sparse(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_write_custom(m_bpk, BPK_TYPE_RFS, 0,
+                    fill_sparse, &pos));
+        bpk_close(m_bpk);
+
+        for (size_t i = 0; i < sizeof (flags) / sizeof (flags[0]); ++i)
+        {
+            m_bpk = bpk_open_flags(m_file, flags[i]);
+            CPPUNIT_ASSERT(m_bpk);
+            CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, 1000));
+
+            data.clear();
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_read_custom(m_bpk, drain_string, &data, 0));
+            CPPUNIT_ASSERT(data == std::string(SZ_1K * 2, '\0'));
+
+            data.clear();
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_read_custom(m_bpk, drain_string, &data, 0));
+            CPPUNIT_ASSERT_EQUAL((size_t) 100 * SZ_4K + 42, data.size());
+            for (pos = 0; pos < data.size(); ++pos)
+                CPPUNIT_ASSERT_EQUAL(sparse_byte(pos),
+                        (unsigned char) data[pos]);
+
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, BPK_TYPE_RFS, 0, NULL, NULL));
+            CPPUNIT_ASSERT_EQUAL(-4,
+                    bpk_read_custom(m_bpk, drain_fail, NULL, 0));
+            CPPUNIT_ASSERT_EQUAL(EPIPE, errno);
+
+            /* positive returns are not errors */
+            pos = 0;
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+            CPPUNIT_ASSERT_EQUAL(0,
+                    bpk_read_custom(m_bpk, drain_count, &pos, 0));
+            CPPUNIT_ASSERT_EQUAL((size_t) SZ_1K * 2, pos);
+            bpk_close(m_bpk);
+        }
+
+        /* corrupted data */
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        ker = m_bpk->poff;
+        bpk_close(m_bpk);
+        corrupt(m_file, ker + 100);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(-5, bpk_read_custom(m_bpk, drain_string, &data, 0));
+        CPPUNIT_ASSERT_EQUAL(EBADMSG, errno);
+
+        data.clear();
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_custom(m_bpk, drain_string, &data,
+                    BPK_READ_NOCHECK));
+        CPPUNIT_ASSERT_EQUAL((size_t) SZ_1K * 2, data.size());
+
+        /* unsupported checksums can still be drained */
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, NULL, NULL));
+        m_bpk->pcksum = 42;
+        CPPUNIT_ASSERT_EQUAL(-2, bpk_read_custom(m_bpk, drain_string, &data, 0));
+        CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+        data.clear();
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_custom(m_bpk, drain_string, &data,
+                    BPK_READ_NOCHECK));
+        CPPUNIT_ASSERT_EQUAL((size_t) SZ_1K * 2, data.size());
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
+
+    struct lend_job {
+        std::string data;
+        size_t pos;
+        size_t chunk;
+    };
+
+    static ssize_t lend_chunks(const void **buf, void *arg)
+    {
+        lend_job *job = (lend_job *) arg;
+        size_t len = job->data.size() - job->pos;
+
+        if (len > job->chunk)
+            len = job->chunk;
+        *buf = job->data.data() + job->pos;
+        job->pos += len;
+        return len;
+    }
+
+    static ssize_t lend_fail(const void **, void *)
+    {
+        return -1;
+    }
+
+    void lend()
+    {
+        lend_job job;
+        std::string data;
+        bpk_size size;
+        int fds[2];
+
+        job.data.assign(SZ_1K * SZ_1K + 42, 'a');
+        job.data.replace(SZ_4K, SZ_4K * 2, SZ_4K * 2, '\0');
+
+        m_bpk = bpk_create(m_file);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL((size_t) 128 * SZ_1K, bpk_get_buffer_size(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_buffer_size(m_bpk, SZ_4K));
+        CPPUNIT_ASSERT_EQUAL((size_t) SZ_4K, bpk_get_buffer_size(m_bpk));
+
+        /* chunks larger than the I/O buffer */
+        job.pos = 0;
+        job.chunk = SZ_1K * SZ_1K / 3;
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write_lend(m_bpk, BPK_TYPE_RFS, 0, lend_chunks, &job));
+        job.pos = 0;
+        job.chunk = 1000;
+        CPPUNIT_ASSERT_EQUAL(0, bpk_set_sparse(m_bpk, 1));
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write_lend(m_bpk, BPK_TYPE_KER, 0, lend_chunks, &job));
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_check_crc(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_KER, 0, &size, NULL));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_read_custom(m_bpk, drain_string, &data, 0));
+        CPPUNIT_ASSERT(data == job.data);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+
+        /* streamed packages buffer the lent data */
+        fds[1] = open(m_file, O_WRONLY | O_TRUNC);
+        CPPUNIT_ASSERT(fds[1] >= 0);
+        m_bpk = bpk_create_stream(fds[1]);
+        close(fds[1]);
+        CPPUNIT_ASSERT(m_bpk);
+        job.pos = 0;
+        CPPUNIT_ASSERT_EQUAL(0,
+                bpk_write_lend(m_bpk, BPK_TYPE_RFS, 0, lend_chunks, &job));
+        CPPUNIT_ASSERT_EQUAL(-4,
+                bpk_write_lend(m_bpk, BPK_TYPE_FWV, 0, lend_fail, NULL));
+        CPPUNIT_ASSERT_EQUAL(EIO, errno);
+        bpk_close(m_bpk);
+
+        m_bpk = bpk_open(m_file, 0);
+        CPPUNIT_ASSERT(m_bpk);
+        CPPUNIT_ASSERT_EQUAL(0, bpk_verify_all(m_bpk, NULL, NULL));
+        CPPUNIT_ASSERT_EQUAL((ssize_t) 1, bpk_count(m_bpk));
+        CPPUNIT_ASSERT_EQUAL(0, bpk_find(m_bpk, BPK_TYPE_RFS, 0, &size, NULL));
+        CPPUNIT_ASSERT_EQUAL((bpk_size) job.data.size(), size);
+        bpk_close(m_bpk);
+        m_bpk = NULL;
+    }
 };
 CPPUNIT_TEST_SUITE_REGISTRATION(opsTest);
 
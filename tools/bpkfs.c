@@ -34,12 +34,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "bpk.h"
-#include "bpk_priv.h"
 #include "bpkfs.h"
 #include "compat/queue.h"
 
@@ -54,8 +55,9 @@ typedef struct partition
     bpk_type type;
     const char *file;
     uint32_t crc;
+    bpk_cksum cksum;
     bpk_size size;
-    off_t offset;
+    uint32_t hw_id;
     STAILQ_ENTRY(partition) parts;
 } partition;
 STAILQ_HEAD(parthead, partition);
@@ -75,6 +77,16 @@ struct bpk_config {
      struct hardhead hards;
 };
 
+/**
+ * @brief opened partition file.
+ * @details FUSE may read the same file from several threads.
+ */
+typedef struct bpkfs_handle
+{
+    bpk_cursor *cur;
+    pthread_mutex_t lock;
+} bpkfs_handle;
+
 static struct bpk_config config;
 
 /**
@@ -159,15 +171,13 @@ static hardware *hardware_new(uint32_t id)
  * @param[in] type the partition type.
  * @param[in] size the partition size.
  * @param[in] crc the partition crc.
- * @param[in] offset the partition offset in the file.
  * @return
  *  - NULL on malloc error.
  */
 static partition *partition_new(
         bpk_type type,
         bpk_size size,
-        uint32_t crc,
-        off_t offset)
+        uint32_t crc)
 {
     partition *p = malloc(sizeof (partition));
     if (p == NULL)
@@ -194,7 +204,6 @@ static partition *partition_new(
             break;
     }
     p->size = size;
-    p->offset = offset;
     return p;
 }
 
@@ -260,7 +269,7 @@ static int bpkfs_init(struct bpk_config *conf)
     if (conf == NULL || conf->path == NULL)
         return -1;
 
-    conf->bpk = bpk_open(conf->path, 0);
+    conf->bpk = bpk_open_flags(conf->path, BPK_OPEN_MMAP);
     if (conf->bpk == NULL)
     {
         fprintf(stderr, "Failed to open bpk file: %s\n", conf->path);
@@ -277,12 +286,14 @@ static int bpkfs_init(struct bpk_config *conf)
 
     while ((type = bpk_next(conf->bpk, &size, &crc, &hw_id)) != BPK_TYPE_INVALID)
     {
-        p = partition_new(type, size, crc, ftell(conf->bpk->fd));
+        p = partition_new(type, size, crc);
         if (p == NULL)
         {
             bpkfs_cleanup(conf);
             return -1;
         }
+        p->cksum = bpk_get_cksum(conf->bpk);
+        p->hw_id = hw_id;
 
         h = bpkfs_find_hw_id(conf, hw_id);
         if (h == NULL)
@@ -299,6 +310,12 @@ static int bpkfs_init(struct bpk_config *conf)
         STAILQ_INSERT_TAIL(&h->parts, p, parts);
     }
 
+    /* partitions are read through cursors, which need the index */
+    if (bpk_count(conf->bpk) < 0)
+    {
+        bpkfs_cleanup(conf);
+        return -1;
+    }
     return 0;
 }
 
@@ -368,7 +385,7 @@ static int bpkfs_getattr(const char *path, struct stat *stbuf)
             part[strlen(part) - SFV_SUFF_LEN] = '\0';
 
         p = bpkfs_find_part(&config, hw_id, part);
-        if (p == NULL)
+        if (p == NULL || (sfv && p->cksum != BPK_CKSUM_CRC32))
             res = -ENOENT;
         else
         {
@@ -428,6 +445,10 @@ static int bpkfs_readdir(
             {
                 filler(buf, p->file, NULL, 0);
 
+                /* sfv files only support crc32 */
+                if (p->cksum != BPK_CKSUM_CRC32)
+                    continue;
+
                 sfv = malloc(strlen(p->file) + 1 + SFV_SUFF_LEN);
                 if (sfv)
                 {
@@ -445,44 +466,87 @@ static int bpkfs_readdir(
 
 static int bpkfs_open(const char *path, struct fuse_file_info *fi)
 {
-    int ret = -ENOENT;
+    partition *p = NULL;
+    bpkfs_handle *h;
+    int sfv = 0;
     char *hw_id, *part;
 
     splitpath(path, &hw_id, &part);
 
     if (part != NULL)
     {
-        if (is_sfv(part))
+        if ((sfv = is_sfv(part)) != 0)
             part[strlen(part) - SFV_SUFF_LEN] = '\0';
 
-        if (bpkfs_find_part(&config, hw_id, part) != NULL)
-            ret = 0;
+        p = bpkfs_find_part(&config, hw_id, part);
     }
     free(hw_id);
 
-    if ((ret == 0) && (fi->flags & 3) != O_RDONLY)
+    if (p == NULL)
+        return -ENOENT;
+    else if ((fi->flags & 3) != O_RDONLY)
         return -EACCES;
 
+    fi->fh = 0;
+    if (sfv)
+        return 0;
+
+    /* each opened partition has its own cursor, found once */
+    h = malloc(sizeof (bpkfs_handle));
+    if (h == NULL)
+        return -ENOMEM;
+    h->cur = bpk_cursor_new(config.bpk);
+    if (h->cur == NULL ||
+            bpk_cursor_find(h->cur, p->type, p->hw_id, NULL, NULL) != 0)
+    {
+        bpk_cursor_free(h->cur);
+        free(h);
+        return -EIO;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    fi->fh = (uintptr_t) h;
+    return 0;
+}
+
+static int bpkfs_release(const char *path, struct fuse_file_info *fi)
+{
+    bpkfs_handle *h = (bpkfs_handle *) (uintptr_t) fi->fh;
+    (void) path;
+
+    if (h != NULL)
+    {
+        bpk_cursor_free(h->cur);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+    }
     return 0;
 }
 
 static int dump_file(
-        bpk *bpk,
+        bpkfs_handle *h,
         const partition *part,
         char *buf,
         size_t size,
         off_t offset)
 {
+    int ret = -EIO;
+
     if (offset < 0)
         return -EINVAL;
+    else if (h == NULL)
+        return -EBADF;
 
     if ((bpk_size) offset >= part->size)
         return 0;
     else if ((bpk_size) (offset + size) > part->size)
         size = part->size - offset;
 
-    return pread(fileno(bpk->fd), buf, size, offset +
-            part->offset);
+    pthread_mutex_lock(&h->lock);
+    if (bpk_cursor_seek(h->cur, offset) == 0 &&
+            bpk_cursor_read(h->cur, buf, size) == size)
+        ret = size;
+    pthread_mutex_unlock(&h->lock);
+    return ret;
 }
 
 static int dump_sfv(
@@ -525,7 +589,6 @@ static int bpkfs_read(
     partition *p;
     int sfv;
     char *hw_id, *part;
-    (void) fi;
 
     splitpath(path, &hw_id, &part);
 
@@ -540,7 +603,8 @@ static int bpkfs_read(
         if (sfv)
             return dump_sfv(p, buf, size, offset);
         else
-            return dump_file(config.bpk, p, buf, size, offset);
+            return dump_file((bpkfs_handle *) (uintptr_t) fi->fh, p, buf,
+                    size, offset);
     }
     return -ENOENT;
 }
@@ -574,6 +638,7 @@ static struct fuse_operations bpk_oper = {
     .getattr    = bpkfs_getattr,
     .readdir    = bpkfs_readdir,
     .open       = bpkfs_open,
+    .release    = bpkfs_release,
     .read       = bpkfs_read,
 };
 #pragma GCC diagnostic warning "-pedantic"
@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "bpk.h"
 #include "compat/queue.h"
@@ -46,21 +48,44 @@ static const struct {
 };
 #define bpk_types_str_size (sizeof (bpk_types_str) / sizeof (bpk_types_str[0]))
 
+static const struct {
+    const char *str;
+    bpk_cksum cksum;
+} bpk_cksums_str[] = {
+    { "crc32", BPK_CKSUM_CRC32 },
+    { "crc32c", BPK_CKSUM_CRC32C },
+    { "xxh3", BPK_CKSUM_XXH3 },
+};
+#define bpk_cksums_str_size (sizeof (bpk_cksums_str) / sizeof (bpk_cksums_str[0]))
+
 static void usage(FILE *out, const char *name)
 {
     fprintf(out, "Usage: %s [options] [-c|-x] [-f] file [-p] type:[hw_id:][z:]file ...\n", name);
     fputs("\nOptions:\n", out);
     fputs("  -h, --help        Show this help message and exit\n", out);
-    fputs("  -f, --file=<f>    Set the file to work on\n", out);
+    fputs("  -f, --file=<f>    Set the file to work on, - for stdin or stdout\n", out);
     fputs("  -p, --part=<f>    Partition to create or extract\n", out);
     fputs("  -c, --create      Creation mode\n", out);
     fputs("  -x, --extract     Extraction mode\n", out);
     fputs("  -l, --list        Partition listing mode\n", out);
     fputs("  -t, --list-types  List supported partition types\n", out);
     fputs("  -k, --check       Check a bpk CRC\n", out);
+    fputs("  -u, --update      Replace (or add) parts in an existing file\n", out);
+    fputs("  -r, --remove      Remove type:hw_id parts from an existing file\n", out);
+    fputs("  -a, --cksum=<a>   Data checksum for created parts (crc32, crc32c, xxh3)\n", out);
+    fputs("  -T, --toc         Add a table of contents for faster opening\n", out);
+    fputs("  -A, --align=<n>   Align created parts data on n bytes (power of 2)\n", out);
+    fputs("  -D, --direct[=<n>] Extract parts with O_DIRECT, using n bytes blocks\n", out);
+    fputs("  -S, --sparse      Leave holes and zero blocks out of created parts\n", out);
+    fputs("  -Z, --compact     Reclaim the space of removed parts when updating\n", out);
     fputs("\nExamples:\n", out);
     fputs("  mkbpk -c test.bpk rootfs:root.img kernel:uImage version:z:version.txt\n", out);
     fputs("  mkbpk -x test.bpk 0xFEETFEET:12:version.txt\n", out);
+    fputs("  mkbpk -r -Z test.bpk version:0\n", out);
+    fputs("  mkbpk -c - rootfs:root.img | ssh host 'cat > test.bpk'\n", out);
+    fputs("  curl -s http://host/test.bpk | mkbpk -x - rootfs:/dev/mmcblk0p2\n", out);
+    fputs("\nEnvironment:\n", out);
+    fputs("  BPK_CRC32         Force crc32 implementation (bytewise, slice8, pclmul)\n", out);
     fputs("\n", out);
 }
 
@@ -101,6 +126,33 @@ static const char *get_bpk_str(bpk_type type)
     return unknown_buff;
 }
 
+static int get_bpk_cksum(const char *cksum_str, bpk_cksum *cksum)
+{
+    unsigned int i;
+
+    for (i = 0; i < bpk_cksums_str_size; ++i)
+    {
+        if (strcmp(bpk_cksums_str[i].str, cksum_str) == 0)
+        {
+            *cksum = bpk_cksums_str[i].cksum;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char *get_bpk_cksum_str(bpk_cksum cksum)
+{
+    unsigned int i;
+
+    for (i = 0; i < bpk_cksums_str_size; ++i)
+    {
+        if (cksum == bpk_cksums_str[i].cksum)
+            return bpk_cksums_str[i].str;
+    }
+    return "unknown";
+}
+
 static int parse_uint32(const char *str, uint32_t *ret)
 {
     long int i;
@@ -185,8 +237,12 @@ static int write_part(struct bpk *bpk, const struct part *p)
         ctrl = zopen(p->file, 1);
         if (ctrl == NULL)
             return -1;
-        ret = bpk_write_custom(bpk, p->type, p->hw_id,
-                (bpk_fill_func) zfill, ctrl);
+        else if (zbuffer(ctrl, bpk_get_buffer_size(bpk)) != 0)
+        {
+            zclose(ctrl);
+            return -1;
+        }
+        ret = bpk_write_lend(bpk, p->type, p->hw_id, zlend, ctrl);
         zclose(ctrl);
         return ret;
     }
@@ -194,15 +250,157 @@ static int write_part(struct bpk *bpk, const struct part *p)
         return bpk_write(bpk, p->type, p->hw_id, p->file);
 }
 
-static int read_part(struct bpk *bpk, bpk_size size, const struct part *p)
+/**
+ * @brief compute the data size of the parts.
+ * @param[out] count the number of parts.
+ * @return the size, 0 if it can't be known.
+ */
+static bpk_size parts_size(struct parthead *parts, size_t *count)
+{
+    struct part *p;
+    struct stat st;
+    bpk_size size = 0;
+
+    *count = 0;
+    STAILQ_FOREACH(p, parts, parts)
+    {
+        if (p->comp || stat(p->file, &st) != 0 || !S_ISREG(st.st_mode))
+            return 0;
+        size += st.st_size;
+        ++*count;
+    }
+    return size;
+}
+
+static int update_part(struct bpk *bpk, const struct part *p)
+{
+    if (!p->comp)
+        return bpk_replace(bpk, p->type, p->hw_id, p->file);
+    else if (bpk_remove(bpk, p->type, p->hw_id) < -1)
+        return -1;
+    return write_part(bpk, p);
+}
+
+static int read_part(struct bpk *bpk, bpk_size size, const struct part *p,
+        int use_direct, size_t direct)
 {
     if (p->comp)
         return bpk_zread_file(bpk, size, p->file);
+    else if (use_direct)
+        return bpk_read_file_direct(bpk, p->file, direct);
     else
         return bpk_read_file(bpk, p->file);
 
 }
 
+#define STREAM_BUFF_SIZE (64 * 1024)
+
+/**
+ * @brief read the current part of a streamed package.
+ * @param[in] out the file to write, NULL to only check the part.
+ * @return
+ *  - 0 on success.
+ *  - -1 on error (errno set by bpk_reader_read).
+ */
+static int copy_stream_part(bpk_reader *rd, FILE *out)
+{
+    static char buff[STREAM_BUFF_SIZE];
+    ssize_t len;
+
+    while ((len = bpk_reader_read(rd, buff, STREAM_BUFF_SIZE)) > 0)
+    {
+        if (out != NULL && fwrite(buff, len, 1, out) != 1)
+            return -1;
+    }
+    return (len == 0) ? 0 : -1;
+}
+
+/**
+ * @brief list, check or extract the parts of a package read on stdin.
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int read_stream(char mode, struct parthead *parts)
+{
+    bpk_reader *rd;
+    struct part *p;
+    FILE *out;
+    bpk_size size;
+    bpk_type type;
+    uint32_t hw_id;
+    int ret = EXIT_SUCCESS, status;
+
+    rd = bpk_reader_new(STDIN_FILENO);
+    if (rd == NULL)
+    {
+        fputs("Failed to open file: -\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (mode == 'l')
+        fputs("Bpk partitions:\n", stdout);
+    while ((status = bpk_reader_next(rd, &type, &size, NULL, &hw_id)) == 0)
+    {
+        if (mode == 'l')
+        {
+            fprintf(stdout, "  %s (size: %llu, hw_id=%.8X)\n", get_bpk_str(type),
+                    (unsigned long long) size, hw_id);
+        }
+        else if (mode == 'k' && copy_stream_part(rd, NULL) != 0)
+        {
+            fputs((errno == EOPNOTSUPP) ? "Not verified: " :
+                    "KO: crc mismatch on ", stdout);
+            fputs(get_bpk_str(type), stdout);
+            fputs("\n", stdout);
+            if (errno != EOPNOTSUPP)
+                ret = EXIT_FAILURE;
+        }
+        else if (mode == 'x')
+        {
+            STAILQ_FOREACH(p, parts, parts)
+            {
+                if (p->type == type && p->hw_id == hw_id)
+                    break;
+            }
+            if (p == NULL)
+                continue;
+            STAILQ_REMOVE(parts, p, part, parts);
+
+            out = (p->comp) ? NULL : fopen(p->file, "w");
+            if (out == NULL || copy_stream_part(rd, out) != 0)
+            {
+                fprintf(stderr, "Failed to read part: %s:%s\n",
+                        get_bpk_str(p->type), p->file);
+                ret = EXIT_FAILURE;
+            }
+            if (out != NULL && fclose(out) != 0)
+                ret = EXIT_FAILURE;
+            free_part(p);
+        }
+    }
+
+    if (mode == 'x')
+    {
+        STAILQ_FOREACH(p, parts, parts)
+        {
+            fprintf(stderr, "Failed to find part: %s\n",
+                    get_bpk_str(p->type));
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (status != 1)
+    {
+        fputs((status == -1) ? "KO: header crc mismatch\n" :
+                "KO: failed to read file\n", (mode == 'k') ? stdout : stderr);
+        ret = EXIT_FAILURE;
+    }
+    else if (mode == 'k' && ret == EXIT_SUCCESS)
+        fputs("OK\n", stdout);
+
+    bpk_reader_free(rd);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     char mode = 0;
@@ -218,19 +416,35 @@ int main(int argc, char **argv)
         { "list", 0, 0, 'l' },
         { "list-types", 0, 0, 't' },
         { "check", 0, 0, 'k' },
+        { "cksum", 1, 0, 'a' },
+        { "toc", 0, 0, 'T' },
+        { "align", 1, 0, 'A' },
+        { "direct", 2, 0, 'D' },
+        { "sparse", 0, 0, 'S' },
+        { "update", 0, 0, 'u' },
+        { "remove", 0, 0, 'r' },
+        { "compact", 0, 0, 'Z' },
         { 0, 0, 0, 0 }
     };
-    uint32_t crc;
     bpk *bpk;
     bpk_size size;
+    size_t nparts;
     bpk_type type;
     uint32_t hw_id;
+    bpk_cksum cksum = BPK_CKSUM_CRC32;
+    int toc = 0;
+    int sparse = 0;
+    unsigned long align = 0;
+    unsigned long direct = 0;
+    int use_direct = 0;
+    int compact = 0;
+    char *end;
     int ret;
     int index = 0;
 
     STAILQ_INIT(&parts);
 
-    while ((c = getopt_long(argc, argv, "-hf:p:cxltk", long_options, &index)) != -1)
+    while ((c = getopt_long(argc, argv, "-hf:p:cxltkurZa:TA:D::S", long_options, &index)) != -1)
     {
         if (c == 1)
             c = (strchr(optarg, ':') != NULL) ? 'p' : 'f';
@@ -259,11 +473,49 @@ int main(int argc, char **argv)
                     STAILQ_INSERT_TAIL(&parts, p, parts);
                 }
                 break;
+            case 'a':
+                if (get_bpk_cksum(optarg, &cksum) != 0)
+                {
+                    fprintf(stderr, "Invalid checksum argument: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                toc = 1;
+                break;
+            case 'S':
+                sparse = 1;
+                break;
+            case 'Z':
+                compact = 1;
+                break;
+            case 'A':
+                align = strtoul(optarg, &end, 0);
+                if (*end != '\0' || (align & (align - 1)) != 0)
+                {
+                    fprintf(stderr, "Invalid alignment argument: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                use_direct = 1;
+                if (optarg != NULL)
+                {
+                    direct = strtoul(optarg, &end, 0);
+                    if (*end != '\0' || (direct % 4096) != 0)
+                    {
+                        fprintf(stderr, "Invalid block size argument: %s\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
             case 'x':
             case 'l':
             case 'c':
             case 't':
             case 'k':
+            case 'u':
+            case 'r':
                 if (mode != 0)
                 {
                     fprintf(stderr, "Too many mode arguments\n");
@@ -307,7 +559,13 @@ int main(int argc, char **argv)
                 fputs("File argument required\n", stderr);
                 exit(EXIT_FAILURE);
             }
-            bpk = bpk_open(file, 0);
+            else if (strcmp(file, "-") == 0)
+            {
+                ret = read_stream(mode, &parts);
+                break;
+            }
+            bpk = bpk_open_flags(file, BPK_OPEN_MMAP |
+                    ((mode == 'x') ? BPK_OPEN_INDEX : 0));
             if (bpk == NULL)
             {
                 fprintf(stderr, "Failed to open file: %s\n", file);
@@ -327,7 +585,7 @@ int main(int argc, char **argv)
                                 get_bpk_str(p->type));
                         ret = EXIT_FAILURE;
                     }
-                    else if (read_part(bpk, size, p) != 0)
+                    else if (read_part(bpk, size, p, use_direct, direct) != 0)
                     {
                         fprintf(stderr, "Failed to read part: %s:%s\n",
                                 get_bpk_str(p->type), p->file);
@@ -340,34 +598,48 @@ int main(int argc, char **argv)
             {
                 fputs("Bpk partitions:\n", stdout);
                 while ((type = bpk_next(bpk, &size, NULL, &hw_id)) != BPK_TYPE_INVALID)
-                    fprintf(stdout, "  %s (size: %lu, hw_id=%.8X)\n", get_bpk_str(type),
-                            (unsigned long) size, hw_id);
+                {
+                    fprintf(stdout, "  %s (size: %llu, hw_id=%.8X", get_bpk_str(type),
+                            (unsigned long long) size, hw_id);
+                    if (bpk_get_cksum(bpk) != BPK_CKSUM_CRC32)
+                        fprintf(stdout, ", cksum=%s",
+                                get_bpk_cksum_str(bpk_get_cksum(bpk)));
+                    fputs(")\n", stdout);
+                }
             }
             else if (mode == 'k')
             {
-                ret = 0;
-                if (bpk_check_crc(bpk) != 0)
-                {
+                bpk_verify_result *results = NULL;
+                size_t i, count = 0, failed = 0;
+
+                ret = bpk_verify_all(bpk, &results, &count);
+                if (ret == -3)
+                    fputs("KO: failed to read file\n", stdout);
+                else if (ret == -1)
                     fputs("KO: header crc mismatch\n", stdout);
-                    ret = EXIT_FAILURE;
-                }
-                else
-                {
 
-                    while ((type = bpk_next(bpk, NULL, &crc, NULL)) != BPK_TYPE_INVALID)
+                for (i = 0; i < count; ++i)
+                {
+                    if (results[i].status != BPK_VERIFY_OK)
                     {
-                        if (bpk_compute_data_crc(bpk) != crc)
-                        {
-                            fputs("KO: crc mismatch on ", stdout);
-                            fputs(get_bpk_str(type), stdout);
-                            ret = EXIT_FAILURE;
-                        }
+                        fputs((results[i].status == BPK_VERIFY_CKSUM) ?
+                                "KO: unsupported checksum on " :
+                                (results[i].status == BPK_VERIFY_TRUNCATED) ?
+                                "KO: truncated data on " :
+                                "KO: crc mismatch on ", stdout);
+                        fputs(get_bpk_str(results[i].type), stdout);
+                        fputs("\n", stdout);
+                        ++failed;
                     }
                 }
+                free(results);
+                if (ret == -2 && failed == 0)
+                    fputs("KO: crc mismatch on an internal part\n", stdout);
+
                 if (ret == 0)
-                {
                     fputs("OK\n", stdout);
-                }
+                else
+                    ret = EXIT_FAILURE;
             }
 
             bpk_close(bpk);
@@ -378,12 +650,27 @@ int main(int argc, char **argv)
                 fputs("File argument required\n", stderr);
                 exit(EXIT_FAILURE);
             }
-            bpk = bpk_create(file);
+            if (strcmp(file, "-") == 0)
+                bpk = bpk_create_stream(STDOUT_FILENO);
+            else
+                bpk = bpk_create(file);
             if (bpk == NULL)
             {
                 fprintf(stderr, "Failed to create file: %s\n", file);
                 exit(EXIT_FAILURE);
             }
+            bpk_set_cksum(bpk, cksum);
+            if (toc)
+                bpk_set_toc(bpk, 1);
+            if (sparse && bpk_set_sparse(bpk, 1) != 0)
+            {
+                fputs("Sparse parts can't be streamed\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+            bpk_set_align(bpk, align);
+            if (!sparse && strcmp(file, "-") != 0 &&
+                    (size = parts_size(&parts, &nparts)) != 0)
+                bpk_set_prealloc(bpk, size, nparts);
 
             while (!STAILQ_EMPTY(&parts))
             {
@@ -398,6 +685,58 @@ int main(int argc, char **argv)
                 }
                 free_part(p);
             }
+            /* streamed packages are only written here */
+            if (strcmp(file, "-") == 0 && bpk_stream_end(bpk) != 0)
+            {
+                fputs("Failed to write the package\n", stderr);
+                ret = EXIT_FAILURE;
+            }
+            bpk_close(bpk);
+            break;
+        case 'u':
+        case 'r':
+            if (file == NULL)
+            {
+                fputs("File argument required\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+            bpk = bpk_open(file, 1);
+            if (bpk == NULL)
+            {
+                fprintf(stderr, "Failed to open file: %s\n", file);
+                exit(EXIT_FAILURE);
+            }
+            bpk_set_cksum(bpk, cksum);
+            if (sparse)
+                bpk_set_sparse(bpk, 1);
+            bpk_set_align(bpk, align);
+
+            while (!STAILQ_EMPTY(&parts))
+            {
+                struct part *p = STAILQ_FIRST(&parts);
+                STAILQ_REMOVE_HEAD(&parts, parts);
+
+                if (mode == 'u' && update_part(bpk, p) != 0)
+                {
+                    fprintf(stderr, "Failed to update part: %s:%s\n",
+                            get_bpk_str(p->type), p->file);
+                    ret = EXIT_FAILURE;
+                }
+                else if (mode == 'r' && (parse_uint32(p->file, &hw_id) != 0 ||
+                            bpk_remove(bpk, p->type, hw_id) != 0))
+                {
+                    fprintf(stderr, "Failed to remove part: %s:%s\n",
+                            get_bpk_str(p->type), p->file);
+                    ret = EXIT_FAILURE;
+                }
+                free_part(p);
+            }
+
+            if (compact && bpk_compact(bpk) != 0)
+            {
+                fprintf(stderr, "Failed to compact file: %s\n", file);
+                ret = EXIT_FAILURE;
+            }
             bpk_close(bpk);
             break;
         default:
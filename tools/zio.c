@@ -40,6 +40,8 @@ struct zctrl
     z_stream strm;
     int deflate;
     uint8_t in[CHUNK];
+    unsigned char *out; /**!< zlend output buffer */
+    size_t out_size;
 };
 
 zctrl *zopen(const char *file, int deflate)
@@ -59,6 +61,8 @@ zctrl *zopen(const char *file, int deflate)
     ctrl->strm.avail_in = 0;
     ctrl->strm.next_in = Z_NULL;
     ctrl->deflate = deflate;
+    ctrl->out = NULL;
+    ctrl->out_size = 0;
 
     if (deflate)
         ret = (deflateInit2(&ctrl->strm, Z_BEST_COMPRESSION, Z_DEFLATED,
@@ -82,6 +86,7 @@ void zclose(zctrl *ctrl)
         deflateEnd(&ctrl->strm);
     else
         inflateEnd(&ctrl->strm);
+    free(ctrl->out);
     free(ctrl);
 }
 
@@ -126,6 +131,29 @@ ssize_t zfill(unsigned char *buf, size_t count, void *attr)
     return count - rem;
 }
 
+int zbuffer(zctrl *ctrl, size_t size)
+{
+    unsigned char *out = realloc(ctrl->out, size);
+
+    if (out == NULL)
+        return -1;
+    ctrl->out = out;
+    ctrl->out_size = size;
+    return 0;
+}
+
+ssize_t zlend(const void **buf, void *attr)
+{
+    zctrl *ctrl = (zctrl *) attr;
+
+    if (ctrl->out == NULL && zbuffer(ctrl, CHUNK * 64) != 0)
+        return -1;
+
+    /* zfill only returns once the buffer is full, or at the end */
+    *buf = ctrl->out;
+    return zfill(ctrl->out, ctrl->out_size, ctrl);
+}
+
 int bpk_zread_file(bpk *bpk, bpk_size size, const char *file)
 {
     zctrl *ctrl;
@@ -51,6 +51,18 @@ void zclose(zctrl *ctrl);
  */
 ssize_t zfill(unsigned char *buf, size_t count, void *attr);
 
+/**
+ * @brief set the size of the zlend output buffer.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int zbuffer(zctrl *ctrl, size_t size);
+
+/**
+ * @brief lend a buffer of compressed data.
+ * @details to be used with bpk_write_lend, the buffer is filled at once.
+ */
+ssize_t zlend(const void **buf, void *attr);
+
 /**
  * @brief write a gzip compressed bpk partition.
  *